@@ -0,0 +1,576 @@
+/* ============================================================
+   PrismaFS - bench/bench.c
+   Benchmark suite, mounts PrismaFS over generated layers
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+
+/* -------------------------------------------------------------
+   generates base layers and an empty session layer in a temp dir,
+   mounts prismafs over them and times the things that matter:
+
+   stat_hit         stat every file of the tree, several rounds
+   stat_miss        stat names that dont exist in any layer
+   readdir_huge     list a directory with entries spread over all layers
+   seq_read         read a big base file front to back (1 MiB reads)
+   rand_read        4 KiB preads at random offsets of that file
+   seq_write        write a new file in session (1 MiB writes)
+   rand_write       4 KiB pwrites at random offsets of that file
+   copyup           first write to base files (one copy-up each)
+   unlink_whiteout  unlink base files (one whiteout each)
+
+   tree: every dir exists in all layers, files go round robin over the
+   layers, so lookups walk past session and the upper layers.
+   results go out as JSON (stdout or -o file), one object per test with
+   ops/s, MB/s where it makes sense, and latency mean/p50/p99/max in us.
+
+   usage: bench [-p prismafs] [-l layers] [-d depth] [-f fanout]
+                [-n files per dir] [-s file size] [-H huge dir entries]
+                [-B big file MiB] [-r stat rounds] [-R random ops]
+                [-m copy-up files] [-C "config line"]... [-o out.json]
+   -------------------------------------------------------------
+*/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LAYERS   256
+#define MAX_EXTRA    16
+#define IO_CHUNK     (1024 * 1024)
+#define RAND_IO_SIZE 4096
+
+// knobs, see usage
+static const char *prismafs = "./prismafs";
+static int    layers    = 2;
+static int    depth     = 3;
+static int    fanout    = 4;
+static int    per_dir   = 8;
+static size_t file_size = 4096;
+static int    huge      = 10000;
+static size_t big_mib   = 64;
+static int    rounds    = 5;
+static int    rand_ops  = 10000;
+static int    cow_files = 200;
+static const char *extra[MAX_EXTRA];
+static int    nextra    = 0;
+static const char *out_path = NULL;
+
+// kept well below PATH_MAX so paths built from them always fit
+static char root[PATH_MAX / 4];        // temp dir holding everything
+static char mnt[PATH_MAX / 2];
+static char base[MAX_LAYERS][PATH_MAX / 2];
+static char session[PATH_MAX / 2];
+
+// paths (relative to the mount) of every generated tree file and dir, "tree/d0/d1/f3"
+static char **files;
+static int nfiles, files_cap;
+static char **dirs;
+static int ndirs, dirs_cap;
+
+static FILE *out;
+static int nresults = 0;
+static int mounted = 0;
+
+static void unmount_fs(void);
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a failing test must not leave the mount behind
+static void die(const char *what)
+{
+    perror(what);
+    if (mounted)
+        unmount_fs();
+    exit(1);
+}
+
+static void push(char ***arr, int *n, int *cap, const char *s)
+{
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        if (!(*arr = realloc(*arr, *cap * sizeof(char *))))
+            die("realloc");
+    }
+    if (!((*arr)[(*n)++] = strdup(s)))
+        die("strdup");
+}
+
+static void make_file(const char *path, size_t size)
+{
+    static char buf[IO_CHUNK];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+        die(path);
+    memset(buf, 'b', sizeof(buf));
+    while (size > 0) {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n)
+            die("write");
+        size -= n;
+    }
+    close(fd);
+}
+
+static void make_dir_all_layers(const char *rel)
+{
+    char p[PATH_MAX];
+
+    for (int l = 0; l < layers; l++) {
+        snprintf(p, sizeof(p), "%s/%s", base[l], rel);
+        if (mkdir(p, 0755) == -1 && errno != EEXIST)
+            die(p);
+    }
+}
+
+// dir exists in every layer, file k goes to layer k % layers
+static void gen_tree(const char *rel, int level)
+{
+    char p[PATH_MAX], child[PATH_MAX / 4];
+
+    push(&dirs, &ndirs, &dirs_cap, rel);
+    for (int k = 0; k < per_dir; k++) {
+        snprintf(child, sizeof(child), "%s/f%d", rel, k);
+        snprintf(p, sizeof(p), "%s/%s", base[k % layers], child);
+        make_file(p, file_size);
+        push(&files, &nfiles, &files_cap, child);
+    }
+    if (level == depth)
+        return;
+    for (int k = 0; k < fanout; k++) {
+        snprintf(child, sizeof(child), "%s/d%d", rel, k);
+        make_dir_all_layers(child);
+        gen_tree(child, level + 1);
+    }
+}
+
+static void generate(void)
+{
+    char p[PATH_MAX];
+
+    make_dir_all_layers("tree");
+    gen_tree("tree", 0);
+
+    make_dir_all_layers("huge");
+    for (int k = 0; k < huge; k++) {
+        snprintf(p, sizeof(p), "%s/huge/e%07d", base[k % layers], k);
+        make_file(p, 0);
+    }
+
+    // copy-up, unlink and big read targets live in the lowest layer (longest walk)
+    const char *low = base[layers - 1];
+    snprintf(p, sizeof(p), "%s/cow", low);
+    mkdir(p, 0755);
+    snprintf(p, sizeof(p), "%s/del", low);
+    mkdir(p, 0755);
+    for (int k = 0; k < cow_files; k++) {
+        snprintf(p, sizeof(p), "%s/cow/c%d", low, k);
+        make_file(p, file_size);
+        snprintf(p, sizeof(p), "%s/del/u%d", low, k);
+        make_file(p, file_size);
+    }
+    snprintf(p, sizeof(p), "%s/big.dat", low);
+    make_file(p, big_mib * 1024 * 1024);
+}
+
+static int is_mounted(void)
+{
+    struct stat a, b;
+    char parent[PATH_MAX];
+
+    snprintf(parent, sizeof(parent), "%s/..", mnt);
+    return stat(mnt, &a) == 0 && stat(parent, &b) == 0 && a.st_dev != b.st_dev;
+}
+
+static void mount_fs(void)
+{
+    char conf[PATH_MAX];
+    snprintf(conf, sizeof(conf), "%s/bench.conf", root);
+
+    FILE *f = fopen(conf, "w");
+    if (!f)
+        die(conf);
+    fprintf(f, "session %s\n", session);
+    for (int l = 0; l < layers; l++)
+        fprintf(f, "base %s\n", base[l]);
+    for (int i = 0; i < nextra; i++)
+        fprintf(f, "%s\n", extra[i]);
+    fclose(f);
+
+    // prismafs daemonizes once mounted, the parent exiting = mount done or failed
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0) {
+        execl(prismafs, prismafs, "-c", conf, mnt, (char *)NULL);
+        perror(prismafs);
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    for (int i = 0; i < 100 && !is_mounted(); i++)
+        usleep(50000);
+    if (!is_mounted()) {
+        fprintf(stderr, "bench: %s did not mount %s\n", prismafs, mnt);
+        exit(1);
+    }
+    mounted = 1;
+}
+
+static void unmount_fs(void)
+{
+    char cmd[PATH_MAX * 2 + 64];
+
+    snprintf(cmd, sizeof(cmd), "fusermount3 -u '%s' 2>/dev/null || umount '%s'", mnt, mnt);
+    mounted = 0;
+    if (system(cmd) != 0)
+        fprintf(stderr, "bench: unmounting %s failed\n", mnt);
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st; (void) flag; (void) ftw;
+    remove(path);
+    return 0;
+}
+
+/* ---- timing and JSON ---- */
+
+struct timing {
+    double *lat;     // seconds per op
+    int n, cap;
+    double start;
+    double total;    // wall clock of the whole test
+    uint64_t bytes;
+};
+
+static void timing_begin(struct timing *t, int expected)
+{
+    t->cap = expected > 0 ? expected : 1;
+    t->lat = malloc(t->cap * sizeof(double));
+    if (!t->lat)
+        die("malloc");
+    t->n = 0;
+    t->bytes = 0;
+    t->start = now();
+}
+
+static void timing_add(struct timing *t, double seconds)
+{
+    if (t->n == t->cap) {
+        t->cap *= 2;
+        if (!(t->lat = realloc(t->lat, t->cap * sizeof(double))))
+            die("realloc");
+    }
+    t->lat[t->n++] = seconds;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct timing *t, double frac)
+{
+    int i = (int)(frac * (t->n - 1) + 0.5);
+    return t->lat[i] * 1e6;
+}
+
+static void report(const char *name, struct timing *t)
+{
+    t->total = now() - t->start;
+    qsort(t->lat, t->n, sizeof(double), cmp_double);
+
+    double sum = 0;
+    for (int i = 0; i < t->n; i++)
+        sum += t->lat[i];
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+            nresults++ ? "," : "", name, t->n, t->total, t->total > 0 ? t->n / t->total : 0);
+    if (t->bytes)
+        fprintf(out, ", \"bytes\": %llu, \"mb_per_sec\": %.1f", (unsigned long long)t->bytes,
+                t->total > 0 ? t->bytes / t->total / (1024 * 1024) : 0);
+    if (t->n > 0)
+        fprintf(out, ",\n     \"lat_us\": {\"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}",
+                sum / t->n * 1e6, percentile(t, 0.50), percentile(t, 0.99), t->lat[t->n - 1] * 1e6);
+    fprintf(out, "}");
+    fflush(out);
+
+    free(t->lat);
+    fprintf(stderr, "bench: %-16s %8d ops %10.1f ops/s\n", name, t->n,
+            t->total > 0 ? t->n / t->total : 0);
+}
+
+static void mnt_path(char out_buf[PATH_MAX], const char *rel)
+{
+    snprintf(out_buf, PATH_MAX, "%s/%s", mnt, rel);
+}
+
+/* ---- tests ---- */
+
+static void bench_stat(void)
+{
+    struct timing t;
+    struct stat st;
+    char p[PATH_MAX];
+
+    timing_begin(&t, nfiles * rounds);
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < nfiles; i++) {
+            mnt_path(p, files[(i * 7919 + r) % nfiles]); // scattered order
+            double t0 = now();
+            if (stat(p, &st) == -1)
+                die(p);
+            timing_add(&t, now() - t0);
+        }
+    }
+    report("stat_hit", &t);
+
+    timing_begin(&t, ndirs * rounds);
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < ndirs; i++) {
+            snprintf(p, sizeof(p), "%s/%s/missing%d", mnt, dirs[i], r);
+            double t0 = now();
+            if (stat(p, &st) == 0) {
+                errno = EEXIST;
+                die(p);
+            }
+            timing_add(&t, now() - t0);
+        }
+    }
+    report("stat_miss", &t);
+}
+
+static void bench_readdir(void)
+{
+    struct timing t;
+    char p[PATH_MAX];
+
+    mnt_path(p, "huge");
+    timing_begin(&t, rounds);
+    for (int r = 0; r < rounds; r++) {
+        double t0 = now();
+        DIR *d = opendir(p);
+        if (!d)
+            die(p);
+        int n = 0;
+        while (readdir(d))
+            n++;
+        closedir(d);
+        timing_add(&t, now() - t0);
+        if (n < huge) {
+            fprintf(stderr, "bench: %s listed %d of %d entries\n", p, n, huge);
+            errno = EIO;
+            die(p);
+        }
+    }
+    report("readdir_huge", &t);
+}
+
+static void bench_seq(const char *name, const char *rel, int writing)
+{
+    static char buf[IO_CHUNK];
+    struct timing t;
+    char p[PATH_MAX];
+    size_t total = big_mib * 1024 * 1024;
+
+    mnt_path(p, rel);
+    int fd = writing ? open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(p, O_RDONLY);
+    if (fd == -1)
+        die(p);
+    memset(buf, 'w', sizeof(buf));
+
+    timing_begin(&t, total / IO_CHUNK);
+    while (t.bytes < total) {
+        double t0 = now();
+        ssize_t n = writing ? write(fd, buf, IO_CHUNK) : read(fd, buf, IO_CHUNK);
+        if (n <= 0)
+            die(name);
+        timing_add(&t, now() - t0);
+        t.bytes += n;
+    }
+    if (writing && fsync(fd) == -1)
+        die("fsync");
+    close(fd);
+    report(name, &t);
+}
+
+static void bench_rand(const char *name, const char *rel, int writing)
+{
+    char buf[RAND_IO_SIZE];
+    struct timing t;
+    char p[PATH_MAX];
+    uint64_t blocks = big_mib * 1024 * 1024 / RAND_IO_SIZE;
+    uint64_t x = 88172645463325252ULL; // xorshift, same offsets every run
+
+    mnt_path(p, rel);
+    int fd = open(p, writing ? O_WRONLY : O_RDONLY);
+    if (fd == -1)
+        die(p);
+    memset(buf, 'r', sizeof(buf));
+
+    timing_begin(&t, rand_ops);
+    for (int i = 0; i < rand_ops; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        off_t off = (off_t)(x % blocks) * RAND_IO_SIZE;
+        double t0 = now();
+        ssize_t n = writing ? pwrite(fd, buf, sizeof(buf), off) : pread(fd, buf, sizeof(buf), off);
+        if (n != (ssize_t)sizeof(buf))
+            die(name);
+        timing_add(&t, now() - t0);
+        t.bytes += n;
+    }
+    close(fd);
+    report(name, &t);
+}
+
+// open + first write + close of a base file, each one a copy-up
+static void bench_copyup(void)
+{
+    struct timing t;
+    char p[PATH_MAX];
+
+    timing_begin(&t, cow_files);
+    for (int k = 0; k < cow_files; k++) {
+        snprintf(p, sizeof(p), "%s/cow/c%d", mnt, k);
+        double t0 = now();
+        int fd = open(p, O_WRONLY);
+        if (fd == -1 || pwrite(fd, "x", 1, 0) != 1)
+            die(p);
+        close(fd);
+        timing_add(&t, now() - t0);
+    }
+    report("copyup", &t);
+}
+
+static void bench_unlink(void)
+{
+    struct timing t;
+    char p[PATH_MAX];
+
+    timing_begin(&t, cow_files);
+    for (int k = 0; k < cow_files; k++) {
+        snprintf(p, sizeof(p), "%s/del/u%d", mnt, k);
+        double t0 = now();
+        if (unlink(p) == -1)
+            die(p);
+        timing_add(&t, now() - t0);
+    }
+    report("unlink_whiteout", &t);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: bench [-p prismafs] [-l layers] [-d depth] [-f fanout] [-n files per dir]\n"
+        "             [-s file size] [-H huge dir entries] [-B big file MiB] [-r stat rounds]\n"
+        "             [-R random ops] [-m copy-up files] [-C \"config line\"]... [-o out.json]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:l:d:f:n:s:H:B:r:R:m:C:o:h")) != -1) {
+        switch (opt) {
+        case 'p': prismafs  = optarg; break;
+        case 'l': layers    = atoi(optarg); break;
+        case 'd': depth     = atoi(optarg); break;
+        case 'f': fanout    = atoi(optarg); break;
+        case 'n': per_dir   = atoi(optarg); break;
+        case 's': file_size = strtoull(optarg, NULL, 10); break;
+        case 'H': huge      = atoi(optarg); break;
+        case 'B': big_mib   = strtoull(optarg, NULL, 10); break;
+        case 'r': rounds    = atoi(optarg); break;
+        case 'R': rand_ops  = atoi(optarg); break;
+        case 'm': cow_files = atoi(optarg); break;
+        case 'C':
+            if (nextra == MAX_EXTRA)
+                usage();
+            extra[nextra++] = optarg;
+            break;
+        case 'o': out_path  = optarg; break;
+        default:  usage();
+        }
+    }
+    if (layers < 1 || layers > MAX_LAYERS || depth < 0 || fanout < 1 || per_dir < 1 ||
+        big_mib < 1 || rounds < 1 || rand_ops < 1 || cow_files < 1 || huge < 1)
+        usage();
+
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out)
+        die(out_path);
+
+    // everything under one temp dir, removed at the end
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp || strlen(tmp) > sizeof(root) - 32)
+        tmp = "/tmp";
+    snprintf(root, sizeof(root), "%s/prismafs-bench.XXXXXX", tmp);
+    if (!mkdtemp(root))
+        die("mkdtemp");
+    snprintf(mnt, sizeof(mnt), "%s/mnt", root);
+    snprintf(session, sizeof(session), "%s/session", root);
+    if (mkdir(mnt, 0755) == -1 || mkdir(session, 0755) == -1)
+        die("mkdir");
+    for (int l = 0; l < layers; l++) {
+        snprintf(base[l], sizeof(base[l]), "%s/base%d", root, l);
+        if (mkdir(base[l], 0755) == -1)
+            die(base[l]);
+    }
+
+    fprintf(stderr, "bench: generating layers in %s\n", root);
+    generate();
+    mount_fs();
+
+    fprintf(out, "{\n  \"config\": {\"layers\": %d, \"depth\": %d, \"fanout\": %d, "
+            "\"files_per_dir\": %d, \"file_size\": %zu, \"files\": %d, \"dirs\": %d,\n"
+            "             \"huge_dir\": %d, \"big_file_mib\": %zu, \"rounds\": %d, "
+            "\"random_ops\": %d, \"copyup_files\": %d, \"extra\": [",
+            layers, depth, fanout, per_dir, file_size, nfiles, ndirs,
+            huge, big_mib, rounds, rand_ops, cow_files);
+    for (int i = 0; i < nextra; i++)
+        fprintf(out, "%s\"%s\"", i ? ", " : "", extra[i]);
+    fprintf(out, "]},\n  \"results\": [");
+
+    bench_stat();
+    bench_readdir();
+    bench_seq("seq_read", "big.dat", 0);
+    bench_rand("rand_read", "big.dat", 0);
+    bench_seq("seq_write", "out.dat", 1);
+    bench_rand("rand_write", "out.dat", 1);
+    bench_copyup();
+    bench_unlink();
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+
+    unmount_fs();
+    nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
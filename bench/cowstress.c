@@ -0,0 +1,220 @@
+/* ============================================================
+   PrismaFS - bench/cowstress.c
+   Concurrent copy-up stress test against a mounted PrismaFS
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+
+/* -------------------------------------------------------------
+   every round puts a fresh file into the base layer, then N threads
+   open it through the mount at the same moment and each writes its own
+   slot. every one of those writes is a first write, so they all race
+   for the copy-up of the same file.
+
+   afterwards the file is read back through the mount: every slot has
+   to hold its threads bytes and everything else the base content.
+   a lost write (copy-up done twice, second one wiping the first) or a
+   torn copy fails the round.
+
+   usage: cowstress <base dir> <mountpoint> [threads] [rounds] [file size]
+   -------------------------------------------------------------
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define SLOT_SIZE 4096
+
+static char mnt_file[PATH_MAX];
+static int  nthreads = 64;
+static pthread_barrier_t start_line;
+
+static char base_byte(off_t off)
+{
+    return 'a' + (off * 7 + off / SLOT_SIZE) % 26;
+}
+
+static char slot_byte(int thread)
+{
+    return '0' + thread % 10 + (thread / 10) % 4 * 10; // a few distinct values per slot
+}
+
+static void *writer(void *arg)
+{
+    int t = (int)(long)arg;
+    char buf[SLOT_SIZE];
+    long failed = 0;
+
+    memset(buf, slot_byte(t), sizeof(buf));
+
+    // everyone opens and writes at once, maximum contention on copy-up
+    pthread_barrier_wait(&start_line);
+
+    int fd = open(mnt_file, O_RDWR);
+    if (fd == -1 || pwrite(fd, buf, SLOT_SIZE, (off_t)t * SLOT_SIZE) != SLOT_SIZE) {
+        fprintf(stderr, "cowstress: thread %d: %s\n", t, strerror(errno));
+        failed = 1;
+    }
+    if (fd != -1)
+        close(fd);
+
+    return (void *)failed;
+}
+
+// creates base file of size bytes with a known pattern
+static int make_base(const char *path, off_t size)
+{
+    char *buf = malloc(SLOT_SIZE);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (!buf || fd == -1) {
+        free(buf);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    for (off_t off = 0; off < size; off += SLOT_SIZE) {
+        size_t len = size - off < SLOT_SIZE ? (size_t)(size - off) : SLOT_SIZE;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = base_byte(off + i);
+        if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+// reads merged file back through the mount, returns number of bad bytes
+static long verify(off_t size)
+{
+    char *buf = malloc(SLOT_SIZE);
+    int fd = open(mnt_file, O_RDONLY);
+    long bad = 0;
+
+    if (!buf || fd == -1) {
+        fprintf(stderr, "cowstress: cannot read back %s: %s\n", mnt_file, strerror(errno));
+        free(buf);
+        if (fd != -1)
+            close(fd);
+        return size;
+    }
+
+    for (off_t off = 0; off < size; off += SLOT_SIZE) {
+        size_t len = size - off < SLOT_SIZE ? (size_t)(size - off) : SLOT_SIZE;
+        if (pread(fd, buf, len, off) != (ssize_t)len) {
+            bad += len;
+            continue;
+        }
+        int t = off / SLOT_SIZE;
+        for (size_t i = 0; i < len; i++) {
+            char want = t < nthreads ? slot_byte(t) : base_byte(off + i);
+            if (buf[i] != want)
+                bad++;
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return bad;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <base dir> <mountpoint> [threads] [rounds] [file size]\n", argv[0]);
+        return 2;
+    }
+
+    const char *base_dir = argv[1];
+    const char *mnt = argv[2];
+    int rounds = 20;
+    off_t size = 8 * 1024 * 1024;
+
+    if (argc > 3) nthreads = atoi(argv[3]);
+    if (argc > 4) rounds = atoi(argv[4]);
+    if (argc > 5) size = strtoll(argv[5], NULL, 10);
+
+    if (nthreads < 1 || rounds < 1 || size < (off_t)nthreads * SLOT_SIZE) {
+        fprintf(stderr, "cowstress: need threads >= 1, rounds >= 1, file size >= threads * %d\n",
+                SLOT_SIZE);
+        return 2;
+    }
+
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (!threads)
+        return 1;
+
+    int failed_rounds = 0;
+    double total = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        char base_file[PATH_MAX];
+        snprintf(base_file, sizeof(base_file), "%s/cowstress.%d", base_dir, r);
+        snprintf(mnt_file, sizeof(mnt_file), "%s/cowstress.%d", mnt, r);
+
+        if (make_base(base_file, size) != 0) {
+            fprintf(stderr, "cowstress: cannot create %s: %s\n", base_file, strerror(errno));
+            return 1;
+        }
+
+        pthread_barrier_init(&start_line, NULL, nthreads);
+        double t0 = now();
+
+        for (long t = 0; t < nthreads; t++)
+            pthread_create(&threads[t], NULL, writer, (void *)t);
+
+        long write_errors = 0;
+        for (int t = 0; t < nthreads; t++) {
+            void *ret;
+            pthread_join(threads[t], &ret);
+            write_errors += (long)ret;
+        }
+
+        double elapsed = now() - t0;
+        total += elapsed;
+        pthread_barrier_destroy(&start_line);
+
+        long bad = verify(size);
+        if (bad || write_errors) {
+            failed_rounds++;
+            printf("round %d: FAIL %ld bad bytes, %ld write errors\n", r, bad, write_errors);
+        } else {
+            printf("round %d: ok %.3f ms\n", r, elapsed * 1000);
+        }
+
+        unlink(mnt_file);  // drops session copy, whites out base path
+        unlink(base_file);
+    }
+
+    printf("%d threads, %d rounds, %lld byte file: %d failed, avg %.3f ms per round\n",
+           nthreads, rounds, (long long)size, failed_rounds, total * 1000 / rounds);
+
+    free(threads);
+    return failed_rounds ? 1 : 0;
+}
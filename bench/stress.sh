@@ -0,0 +1,25 @@
+#!/bin/sh
+# stress.sh - concurrent copy-up stress test for PrismaFS
+# mounts a throwaway base/session pair and runs cowstress against it.
+# usage: bench/stress.sh [threads] [rounds]   (cow_mode via COW_MODE=sparse)
+
+THREADS=${1:-64}
+ROUNDS=${2:-20}
+
+BASE=$(mktemp -d)
+SESSION=$(mktemp -d)
+MNT=$(mktemp -d)
+CONF=$(mktemp)
+echo "base $BASE" > $CONF
+echo "session $SESSION" >> $CONF
+[ -n "$COW_MODE" ] && echo "cow_mode $COW_MODE" >> $CONF
+
+./prismafs -c $CONF $MNT
+sleep 0.5
+
+bench/cowstress $BASE $MNT $THREADS $ROUNDS
+STATUS=$?
+
+umount $MNT 2>/dev/null || fusermount3 -u $MNT
+rm -rf $BASE $SESSION $MNT $CONF
+exit $STATUS
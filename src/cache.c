@@ -0,0 +1,316 @@
+/* ============================================================
+   PrismaFS - cache.c
+   Resolved-path lookup cache
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#include <time.h>
+
+/* -------------------------------------------------------------
+   resolving a virtual path means: access() on <path>.deleted, lstat in
+   session, then lstat in every base layer until found. with 10 base
+   layers a miss costs 12 syscalls, and tools like make stat the same
+   headers thousands of times.
+
+   cache remembers where a path resolved to (whiteout / session /
+   base layer index) for lookup_ttl seconds.
+
+   paths that exist nowhere go into a separate negative table for
+   negative_ttl seconds. compilers and module loaders probe many more
+   missing paths than existing ones, sharing one table would let the
+   misses evict every useful entry.
+
+   table is direct mapped: slot = hash & mask, a colliding path simply
+   replaces the old entry. that keeps memory bounded and lookups O(1).
+   slots are guarded by striped mutexes so threads rarely contend.
+   -------------------------------------------------------------
+*/
+
+#define LOOKUP_STRIPES 64
+
+struct lookup_entry {
+    uint64_t hash;
+    double   expires;   // monotonic seconds, entry dead after this
+    int      layer;     // RESOLVE_* or base layer index
+    char    *path;      // owned copy of virtual path, NULL = empty slot
+};
+
+double lookup_ttl         = 1.0;    // seconds, 0 disables the cache
+size_t lookup_cache_slots = 65536;  // rounded up to power of 2
+double negative_ttl         = 1.0;  // seconds, 0 = misses go to the lookup cache
+size_t negative_cache_slots = 16384;
+
+/* bumped with every invalidation, for state kept outside these caches
+   (lowlevel.c keeps directory fds per inode):
+   entry_gen     - something was created or copied up into session
+   namespace_gen - a directory was renamed or removed */
+uint64_t entry_gen = 0;
+uint64_t namespace_gen = 0;
+
+struct lookup_table {
+    struct lookup_entry *slots;   // NULL = disabled
+    size_t mask;
+    pthread_mutex_t locks[LOOKUP_STRIPES];
+};
+
+static struct lookup_table lookups;
+static struct lookup_table negatives;  // layer is always RESOLVE_ENOENT
+
+// FNV-1a, cheap and good enough for path strings
+uint64_t path_hash(const char *s)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+double monotonic_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void table_init(struct lookup_table *t, size_t slots, const char *what)
+{
+    size_t n = 1;
+    while (n < slots)
+        n <<= 1;
+
+    t->slots = calloc(n, sizeof(struct lookup_entry));
+    if (!t->slots) {
+        fprintf(stderr, "prismafs: %s disabled, out of memory\n", what);
+        return;
+    }
+    t->mask = n - 1;
+
+    for (int i = 0; i < LOOKUP_STRIPES; i++)
+        pthread_mutex_init(&t->locks[i], NULL);
+}
+
+void lookup_cache_init(void)
+{
+    // disabled, resolve_path always walks the layers
+    if (lookup_ttl > 0 && lookup_cache_slots > 0)
+        table_init(&lookups, lookup_cache_slots, "lookup cache");
+    if (negative_ttl > 0 && negative_cache_slots > 0)
+        table_init(&negatives, negative_cache_slots, "negative lookup cache");
+}
+
+// cached layer of path into *layer, 0 = not cached or expired
+static int table_get(struct lookup_table *t, const char *path, uint64_t h, double now, int *layer)
+{
+    size_t slot = h & t->mask;
+    pthread_mutex_t *lock = &t->locks[slot % LOOKUP_STRIPES];
+    struct lookup_entry *e = &t->slots[slot];
+    int hit = 0;
+
+    pthread_mutex_lock(lock);
+    if (e->path && e->hash == h && e->expires > now && strcmp(e->path, path) == 0) {
+        *layer = e->layer;
+        hit = 1;
+    }
+    pthread_mutex_unlock(lock);
+    return hit;
+}
+
+/* stores a resolution made while entry_gen was gen. if anything got
+   invalidated since, the result may predate that change and is dropped:
+   invalidations bump entry_gen before dropping entries, so a put that
+   still sees gen here lands before the drop and gets removed by it */
+static void table_put(struct lookup_table *t, const char *path, uint64_t h, int layer,
+                      double expires, uint64_t gen)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+
+    size_t slot = h & t->mask;
+    pthread_mutex_t *lock = &t->locks[slot % LOOKUP_STRIPES];
+    struct lookup_entry *e = &t->slots[slot];
+
+    pthread_mutex_lock(lock);
+    if (__atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE) != gen) {
+        pthread_mutex_unlock(lock);
+        free(copy);
+        return;
+    }
+    free(e->path);
+    e->path = copy;
+    e->hash = h;
+    e->layer = layer;
+    e->expires = expires;
+    pthread_mutex_unlock(lock);
+}
+
+static void table_drop(struct lookup_table *t, const char *path)
+{
+    if (!t->slots)
+        return;
+
+    uint64_t h = path_hash(path);
+    size_t slot = h & t->mask;
+    pthread_mutex_t *lock = &t->locks[slot % LOOKUP_STRIPES];
+    struct lookup_entry *e = &t->slots[slot];
+
+    pthread_mutex_lock(lock);
+    if (e->path && e->hash == h && strcmp(e->path, path) == 0) {
+        free(e->path);
+        e->path = NULL;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+static void table_flush(struct lookup_table *t)
+{
+    if (!t->slots)
+        return;
+
+    for (int i = 0; i < LOOKUP_STRIPES; i++)
+        pthread_mutex_lock(&t->locks[i]);
+
+    for (size_t slot = 0; slot <= t->mask; slot++) {
+        free(t->slots[slot].path);
+        t->slots[slot].path = NULL;
+    }
+
+    for (int i = LOOKUP_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&t->locks[i]);
+}
+
+// walk the layers the slow way (this is what every op used to do inline)
+static int resolve_uncached(const char *path)
+{
+    struct stat st;
+    char deleted_marker[PATH_MAX];
+    const char *rel = layer_relpath(path);
+
+    snprintf(deleted_marker, PATH_MAX, "%s.deleted", path + 1);
+
+    // is there .deleted marker in session layer?
+    if (faccessat(session_root_fd, deleted_marker, F_OK, 0) == 0)
+        return RESOLVE_WHITEOUT;
+
+    if (fstatat(session_root_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        return RESOLVE_SESSION;
+
+    // one probe instead of a stat per base layer when the dir is indexed
+    int owner = layer_index_owner_path(path);
+    if (owner != OWNER_UNKNOWN)
+        return owner;
+
+    for (int i = 0; i < num_base_layers; i++) {
+        if (base_manifests[i] ? manifest_find(base_manifests[i], path) != NULL
+                              : fstatat(base_root_fds[i], rel, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            return i;
+    }
+
+    return RESOLVE_ENOENT;
+}
+
+// rebuild real path from a layer code, NULL fpath = caller only wants the code
+static int layer_fullpath(char *fpath, int layer, const char *path)
+{
+    stats_layer_hit(layer);
+    if (!fpath)
+        return layer;
+    if (layer >= 0)
+        base_layer_fullpath(fpath, layer, path);
+    else
+        session_fullpath(fpath, path);
+    return layer;
+}
+
+/* resolves virtual path to the layer serving it.
+   returns RESOLVE_SESSION or a base layer index (>= 0) with fpath set to
+   the real path, RESOLVE_WHITEOUT / RESOLVE_ENOENT when it doesnt exist.
+   fpath may be NULL when caller goes through layer_root_fd() + *at(). */
+int resolve_path(const char *path, char *fpath)
+{
+    if (!lookups.slots && !negatives.slots)
+        return layer_fullpath(fpath, resolve_uncached(path), path);
+
+    uint64_t h = path_hash(path);
+    double now = monotonic_now();
+    int layer;
+
+    if (lookups.slots && table_get(&lookups, path, h, now, &layer))
+        return layer_fullpath(fpath, layer, path);
+    if (negatives.slots && table_get(&negatives, path, h, now, &layer))
+        return layer_fullpath(fpath, layer, path);
+
+    // miss, resolve without holding a lock (syscalls can be slow)
+    uint64_t gen = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
+    layer = resolve_uncached(path);
+
+    // same guard for misses, a file created meanwhile must not read as ENOENT
+    if (layer == RESOLVE_ENOENT && negatives.slots)
+        table_put(&negatives, path, h, layer, now + negative_ttl, gen);
+    else if (lookups.slots)
+        table_put(&lookups, path, h, layer, now + lookup_ttl, gen);
+
+    return layer_fullpath(fpath, layer, path);
+}
+
+/* drop cached resolution of one path, called by ops that mutate it.
+   creates land here too, so a cached miss never hides a new file */
+void lookup_invalidate(const char *path)
+{
+    table_drop(&lookups, path);
+    table_drop(&negatives, path);
+}
+
+/* drop everything. directory rename/rmdir changes resolution of every
+   path below it, and a direct mapped table cant find those by prefix. */
+void lookup_flush(void)
+{
+    table_flush(&lookups);
+    table_flush(&negatives);
+}
+
+// parent of a virtual path: "/a/b" -> "/a", "/a" -> "/"
+void parent_path(char parent[PATH_MAX], const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+
+    if (len == 0) {
+        strcpy(parent, "/");
+        return;
+    }
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+}
+
+/* one path was created, removed or moved to another layer.
+   forget how it resolved and the cached listing of its parent dir */
+void invalidate_path(const char *path)
+{
+    char parent[PATH_MAX];
+
+    // bump first, a resolution racing with this one is then never stored
+    __atomic_add_fetch(&entry_gen, 1, __ATOMIC_RELEASE);
+    lookup_invalidate(path);
+    parent_path(parent, path);
+    dircache_invalidate(parent);
+}
+
+// whole subtree changed (dir rename, rmdir), drop every cache
+void invalidate_all(void)
+{
+    __atomic_add_fetch(&entry_gen, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&namespace_gen, 1, __ATOMIC_RELEASE);
+    lookup_flush();
+    dircache_flush();
+}
@@ -0,0 +1,557 @@
+/* ============================================================
+   PrismaFS - cowmap.c
+   Sparse (block level) copy-up
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#include <stddef.h>     // offsetof
+
+/* -------------------------------------------------------------
+   full copy-up makes a 4 byte pwrite into a 20 GB base file copy 20 GB.
+   with "cow_mode sparse" the session file is instead created sparse at
+   full size and only blocks that get written are copied from base.
+
+   which blocks are already in session is tracked by a bitmap in a
+   sidecar file next to the session copy: <file>.cowmap
+
+     header | base file path | bitmap (1 bit per cow_block bytes)
+
+   reads take untouched blocks from the base file. once every block is
+   in session the sidecar is removed and the file is a normal file again.
+   everything past base_size (appended or after truncate) is session.
+
+   sidecar is written before the session file is renamed into place,
+   so a crash in between leaves a stray map and no session file (base
+   still serves the path, next copy-up starts over) instead of a zero
+   filled copy.
+
+   "metacopy on" reuses the same map for chmod, chown, utimens and xattr
+   changes of a base file: the session copy is a sparse stub with no
+   block copied yet, carrying only mode, owner, times and xattrs. data
+   follows block by block on the first real write or truncate, like any
+   other sparse copy.
+   -------------------------------------------------------------
+*/
+
+#define COWMAP_MAGIC  "PRSMAP1"
+#define COWMAP_SUFFIX ".cowmap"
+
+int      cow_mode  = COW_MODE_FULL;
+uint64_t cow_block = 256 * 1024;
+int      metacopy  = 0;
+
+struct cowmap_header {
+    char     magic[8];
+    uint64_t block_size;
+    uint64_t base_size;    // bytes served from base, shrinks on truncate
+    uint32_t path_len;     // base file path follows header
+    uint32_t pad;
+};
+
+struct cowmap {
+    dev_t dev;                 // session file identity, key in open_maps
+    ino_t ino;
+    int refs;                  // handles sharing this map, guarded by maps_lock
+    int map_fd;                // sidecar, bitmap persisted here
+    int base_fd;               // base file for blocks not copied yet
+    char *map_path;
+    uint64_t block_size;
+    uint64_t base_size;
+    uint64_t missing;          // blocks below base_size not in session yet
+    off_t bits_off;            // where the bitmap starts in the sidecar
+    uint8_t *bits;             // set bits only ever go 0 -> 1
+    int complete;
+    pthread_mutex_t lock;      // serializes filling blocks
+    struct cowmap *next;
+};
+
+// every map in use is shared by all handles of the same session file
+static struct cowmap *open_maps = NULL;
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cowmap_sidecar(char out[PATH_MAX], const char *session_fpath)
+{
+    snprintf(out, PATH_MAX, "%s%s", session_fpath, COWMAP_SUFFIX);
+}
+
+/* 1 when name (relative to dirfd) ends in .cowmap and holds a map header.
+   a user file that only happens to be called that is left alone */
+int cowmap_is_sidecar(int dirfd, const char *name)
+{
+    size_t len = strlen(name), slen = strlen(COWMAP_SUFFIX);
+    char magic[sizeof(COWMAP_MAGIC)];
+
+    if (len <= slen || strcmp(name + len - slen, COWMAP_SUFFIX) != 0)
+        return 0;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return n == (ssize_t)sizeof(magic) && memcmp(magic, COWMAP_MAGIC, sizeof(magic)) == 0;
+}
+
+static uint64_t blocks_for(uint64_t size, uint64_t block_size)
+{
+    return (size + block_size - 1) / block_size;
+}
+
+static int bit_isset(const struct cowmap *m, uint64_t b)
+{
+    return (__atomic_load_n(&m->bits[b / 8], __ATOMIC_ACQUIRE) >> (b % 8)) & 1;
+}
+
+/* creates sidecar then a sparse session file of the same size as base.
+   no data is copied here. 0 = success, -errno = failure. */
+int cowmap_create(const char *base_fpath, const char *session_fpath, mode_t mode)
+{
+    struct stat st;
+    char map_path[PATH_MAX];
+
+    if (stat(base_fpath, &st) == -1)
+        return -errno;
+
+    cowmap_sidecar(map_path, session_fpath);
+
+    struct cowmap_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, COWMAP_MAGIC, sizeof(COWMAP_MAGIC));
+    hdr.block_size = cow_block;
+    hdr.base_size = st.st_size;
+    hdr.path_len = strlen(base_fpath);
+
+    off_t bits_off = sizeof(hdr) + hdr.path_len;
+    off_t map_size = bits_off + (off_t)((blocks_for(st.st_size, cow_block) + 7) / 8);
+
+    int map_fd = open(map_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (map_fd == -1)
+        return -errno;
+
+    // bitmap starts all zero: ftruncate extends with zeros
+    if (pwrite(map_fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        pwrite(map_fd, base_fpath, hdr.path_len, sizeof(hdr)) != (ssize_t)hdr.path_len ||
+        ftruncate(map_fd, map_size) == -1) {
+        close(map_fd);
+        unlink(map_path);
+        return -EIO;
+    }
+    close(map_fd);
+
+    char tmp[PATH_MAX];
+    int fd = cow_tmpfile(tmp, session_fpath, mode);
+    if (fd == -1) {
+        int err = errno;
+        unlink(map_path);
+        return -err;
+    }
+
+    // sparse, takes no space until blocks are written
+    if (ftruncate(fd, st.st_size) == -1 || rename(tmp, session_fpath) == -1) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        unlink(map_path);
+        return -err;
+    }
+    close(fd);
+
+    // a copy-up like any other in /dev/stats, its bytes come as blocks fill
+    cow_count(COW_SPARSE, 1, 0);
+    return 0;
+}
+
+static void cowmap_free(struct cowmap *m)
+{
+    if (m->map_fd != -1)
+        close(m->map_fd);
+    if (m->base_fd != -1)
+        close(m->base_fd);
+    pthread_mutex_destroy(&m->lock);
+    free(m->map_path);
+    free(m->bits);
+    free(m);
+}
+
+/* reads sidecar into a new map. 0 with *mp = NULL when the file has no
+   map header (a user file that only has the name), -EIO when it has one
+   but the map or its base file cant be used, -ENOMEM */
+static int cowmap_load(const char *map_path, int map_fd, struct cowmap **mp)
+{
+    struct cowmap_header hdr;
+    char base_fpath[PATH_MAX];
+
+    *mp = NULL;
+    ssize_t n = pread(map_fd, &hdr, sizeof(hdr), 0);
+    if (n < (ssize_t)sizeof(hdr.magic) || memcmp(hdr.magic, COWMAP_MAGIC, sizeof(COWMAP_MAGIC)) != 0)
+        return n == -1 ? -EIO : 0;
+    if (n != (ssize_t)sizeof(hdr) || hdr.block_size == 0 || hdr.path_len >= PATH_MAX)
+        return -EIO;
+
+    if (pread(map_fd, base_fpath, hdr.path_len, sizeof(hdr)) != (ssize_t)hdr.path_len)
+        return -EIO;
+    base_fpath[hdr.path_len] = '\0';
+
+    struct cowmap *m = calloc(1, sizeof(*m));
+    if (!m)
+        return -ENOMEM;
+
+    uint64_t nblocks = blocks_for(hdr.base_size, hdr.block_size);
+    size_t nbytes = (nblocks + 7) / 8;
+
+    m->map_fd = map_fd;
+    m->base_fd = open(base_fpath, O_RDONLY);
+    m->map_path = strdup(map_path);
+    m->block_size = hdr.block_size;
+    m->base_size = hdr.base_size;
+    m->bits_off = sizeof(hdr) + hdr.path_len;
+    m->bits = calloc(nbytes ? nbytes : 1, 1);
+    pthread_mutex_init(&m->lock, NULL);
+
+    int err = !m->map_path || !m->bits ? -ENOMEM : m->base_fd == -1 ? -EIO : 0;
+    if (err == 0 && pread(map_fd, m->bits, nbytes, m->bits_off) != (ssize_t)nbytes)
+        err = -EIO;
+    if (err != 0) {
+        m->map_fd = -1; // caller still owns it
+        cowmap_free(m);
+        return err;
+    }
+
+    for (uint64_t b = 0; b < nblocks; b++)
+        if (!bit_isset(m, b))
+            m->missing++;
+
+    *mp = m;
+    return 0;
+}
+
+/* map of session file for virtual path if it was copied up sparse.
+   *mp = NULL when the file is complete (no sidecar). a sidecar that
+   cant be used is an error: without it blocks never copied up would
+   read as zeros. session_fd is used for identity. 0 or -errno */
+int cowmap_open(const char *path, int session_fd, struct cowmap **mp)
+{
+    char map_path[PATH_MAX];
+    struct stat st;
+    int res;
+
+    *mp = NULL;
+
+    // probe relative to session root, this runs on every open of a session file
+    cowmap_sidecar(map_path, layer_relpath(path));
+
+    int map_fd = openat(session_root_fd, map_path, O_RDWR | O_CLOEXEC);
+    if (map_fd == -1)
+        return errno == ENOENT ? 0 : -errno; // ENOENT is the normal case, file is complete
+
+    char session_fpath[PATH_MAX];
+    session_fullpath(session_fpath, path);
+    cowmap_sidecar(map_path, session_fpath);
+
+    if (fstat(session_fd, &st) == -1) {
+        res = -errno;
+        close(map_fd);
+        return res;
+    }
+
+    pthread_mutex_lock(&maps_lock);
+
+    // already open through another handle, share it
+    for (struct cowmap *m = open_maps; m; m = m->next) {
+        if (m->dev == st.st_dev && m->ino == st.st_ino) {
+            m->refs++;
+            pthread_mutex_unlock(&maps_lock);
+            close(map_fd);
+            *mp = m;
+            return 0;
+        }
+    }
+
+    struct cowmap *m;
+    res = cowmap_load(map_path, map_fd, &m);
+    if (!m) {
+        pthread_mutex_unlock(&maps_lock);
+        close(map_fd);
+        if (res != 0)
+            fprintf(stderr, "prismafs: unusable copy-up map %s: %s\n", map_path, strerror(-res));
+        return res;
+    }
+
+    // every block made it over (map was moved by rename), file is complete
+    if (m->missing == 0) {
+        pthread_mutex_unlock(&maps_lock);
+        unlink(map_path);
+        cowmap_free(m);
+        return 0;
+    }
+
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->refs = 1;
+    m->next = open_maps;
+    open_maps = m;
+
+    pthread_mutex_unlock(&maps_lock);
+    *mp = m;
+    return 0;
+}
+
+void cowmap_put(struct cowmap *m)
+{
+    if (!m)
+        return;
+
+    pthread_mutex_lock(&maps_lock);
+    if (--m->refs > 0) {
+        pthread_mutex_unlock(&maps_lock);
+        return;
+    }
+
+    for (struct cowmap **pp = &open_maps; *pp; pp = &(*pp)->next) {
+        if (*pp == m) {
+            *pp = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&maps_lock);
+
+    cowmap_free(m);
+}
+
+/* last missing block arrived, file is a normal session file from now on.
+   map_path is where the sidecar was at open, a rename since may have
+   moved it away and put another file's map there: only the sidecar
+   still open as map_fd is removed. one moved elsewhere has every bit
+   set and goes on its next open */
+static void cowmap_finish(struct cowmap *m)
+{
+    struct stat open_st, path_st;
+
+    m->complete = 1;
+    if (fstat(m->map_fd, &open_st) == 0 && lstat(m->map_path, &path_st) == 0 &&
+        open_st.st_dev == path_st.st_dev && open_st.st_ino == path_st.st_ino)
+        unlink(m->map_path);
+}
+
+// copies block b from base into session and records it. caller holds m->lock
+static int cowmap_fill_block(struct cowmap *m, int session_fd, uint64_t b, char *buf)
+{
+    off_t pos = (off_t)(b * m->block_size);
+    size_t len = m->block_size;
+
+    if ((uint64_t)pos + len > m->base_size)
+        len = m->base_size - pos;
+
+    ssize_t n = pread(m->base_fd, buf, len, pos);
+    if (n == -1)
+        return -errno;
+    if (n > 0 && pwrite(session_fd, buf, n, pos) != n)
+        return -EIO;
+    cow_count(COW_SPARSE, 0, n);
+
+    // data first, then bit. bit is persisted so remounts see it too
+    uint8_t byte = __atomic_or_fetch(&m->bits[b / 8], (uint8_t)(1u << (b % 8)), __ATOMIC_RELEASE);
+    if (pwrite(m->map_fd, &byte, 1, m->bits_off + b / 8) != 1)
+        return -EIO;
+
+    m->missing--;
+    return 0;
+}
+
+/* makes sure every block overlapping [off, off + len) is in session
+   before it gets written. cost depends on write size, not file size. */
+int cowmap_fill(struct cowmap *m, int session_fd, off_t off, size_t len)
+{
+    if (len == 0 || m->complete || (uint64_t)off >= m->base_size)
+        return 0;
+
+    uint64_t first = off / m->block_size;
+    uint64_t last = (off + len - 1) / m->block_size;
+    uint64_t limit = blocks_for(m->base_size, m->block_size);
+    char *buf = NULL;
+    int ret = 0;
+
+    if (last >= limit)
+        last = limit - 1;
+
+    pthread_mutex_lock(&m->lock);
+    for (uint64_t b = first; b <= last && !m->complete; b++) {
+        if (bit_isset(m, b))
+            continue;
+        if (!buf && !(buf = malloc(m->block_size))) {
+            ret = -ENOMEM;
+            break;
+        }
+        if ((ret = cowmap_fill_block(m, session_fd, b, buf)) != 0)
+            break;
+    }
+    if (ret == 0 && m->missing == 0 && !m->complete)
+        cowmap_finish(m);
+    pthread_mutex_unlock(&m->lock);
+
+    free(buf);
+    return ret;
+}
+
+/* reads [off, off + size): untouched blocks from base, everything else
+   from session. consecutive blocks from the same side go in one pread. */
+/* longest run starting at pos (at most size bytes) served by one fd:
+   base file for blocks not copied yet, session copy for the rest.
+   read and read_buf both walk the file with this. */
+size_t cowmap_extent(struct cowmap *m, int session_fd, off_t pos, size_t size, int *fd)
+{
+    int from_base = !m->complete && (uint64_t)pos < m->base_size &&
+                    !bit_isset(m, pos / m->block_size);
+
+    // extend run while following blocks come from the same side
+    uint64_t b = pos / m->block_size;
+    off_t run_end = (off_t)((b + 1) * m->block_size);
+    while ((size_t)(run_end - pos) < size) {
+        uint64_t nb = run_end / m->block_size;
+        int nb_base = !m->complete && (uint64_t)run_end < m->base_size && !bit_isset(m, nb);
+        if (nb_base != from_base)
+            break;
+        run_end += m->block_size;
+    }
+
+    size_t chunk = run_end - pos;
+    if (chunk > size)
+        chunk = size;
+    if (from_base && (uint64_t)(pos + chunk) > m->base_size)
+        chunk = m->base_size - pos;
+
+    *fd = from_base ? m->base_fd : session_fd;
+    return chunk;
+}
+
+ssize_t cowmap_read(struct cowmap *m, int session_fd, char *buf, size_t size, off_t off)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        int fd;
+        size_t chunk = cowmap_extent(m, session_fd, off + done, size - done, &fd);
+
+        ssize_t n = pread(fd, buf + done, chunk, off + done);
+        if (n == -1)
+            return -errno;
+        done += n;
+        if ((size_t)n < chunk)
+            break; // EOF
+    }
+    return done;
+}
+
+/* truncate below base_size: block holding the new end is copied first
+   (its head still comes from base), then everything from the new size
+   on counts as session. caller does the actual ftruncate after. */
+int cowmap_truncate(struct cowmap *m, int session_fd, off_t size)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->complete || (uint64_t)size >= m->base_size)
+        goto out;
+
+    uint64_t b = size / m->block_size;
+    if (size % m->block_size && !bit_isset(m, b)) {
+        char *buf = malloc(m->block_size);
+        if (!buf) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        ret = cowmap_fill_block(m, session_fd, b, buf);
+        free(buf);
+        if (ret != 0)
+            goto out;
+    }
+
+    m->base_size = size;
+    uint64_t base_size = size;
+    if (pwrite(m->map_fd, &base_size, sizeof(base_size),
+               offsetof(struct cowmap_header, base_size)) != sizeof(base_size)) {
+        ret = -EIO;
+        goto out;
+    }
+
+    // recount what is still missing below the new base_size
+    m->missing = 0;
+    for (uint64_t i = 0; i < blocks_for(m->base_size, m->block_size); i++)
+        if (!bit_isset(m, i))
+            m->missing++;
+    if (m->missing == 0)
+        cowmap_finish(m);
+
+out:
+    pthread_mutex_unlock(&m->lock);
+    return ret;
+}
+
+/* copy-up of a regular base file used by write, truncate, chmod, chown
+   and xattr changes. sparse mode only pays off for files bigger than
+   one block, smaller ones are copied whole.
+
+   serialized per session path (copyup_lock). a thread that waited for
+   another one doing the same copy-up keeps that copy, it may already
+   hold the other threads writes.
+   0 = copied, 1 = already in session, -errno = failure. */
+static int copy_up(const char *base_fpath, const char *session_fpath, mode_t mode, int meta)
+{
+    struct stat st;
+    char map_path[PATH_MAX];
+    int ret;
+
+    copyup_lock(session_fpath);
+
+    if (access(session_fpath, F_OK) == 0) {
+        copyup_unlock(session_fpath);
+        return 1;
+    }
+
+    /* a map left over from a crashed sparse copy-up is replaced (sparse)
+       or must not apply (full). a user file that just has the sidecar name
+       is neither, it stays and this copy-up goes the full way */
+    cowmap_sidecar(map_path, session_fpath);
+    if (access(map_path, F_OK) == 0 && !cowmap_is_sidecar(AT_FDCWD, map_path)) {
+        ret = cow_file(base_fpath, session_fpath, mode);
+    } else if (meta && stat(base_fpath, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // stub keeps base times, only the metadata change itself is new
+#ifdef __APPLE__
+        struct timespec times[2] = { st.st_atimespec, st.st_mtimespec };
+#else
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+#endif
+        ret = cowmap_create(base_fpath, session_fpath, mode);
+        if (ret == 0)
+            utimensat(AT_FDCWD, session_fpath, times, 0);
+    } else if (cow_mode == COW_MODE_SPARSE && stat(base_fpath, &st) == 0 &&
+        S_ISREG(st.st_mode) && (uint64_t)st.st_size > cow_block) {
+        ret = cowmap_create(base_fpath, session_fpath, mode);
+    } else {
+        unlink(map_path);
+        ret = cow_file(base_fpath, session_fpath, mode);
+    }
+
+    copyup_unlock(session_fpath);
+    return ret;
+}
+
+int copy_up_data(const char *base_fpath, const char *session_fpath, mode_t mode)
+{
+    return copy_up(base_fpath, session_fpath, mode, 0);
+}
+
+/* copy-up for a metadata change only (chmod, chown, utimens, xattrs).
+   with metacopy on a regular file becomes a stub without data, otherwise
+   same as copy_up_data(). */
+int copy_up_meta(const char *base_fpath, const char *session_fpath, mode_t mode)
+{
+    return copy_up(base_fpath, session_fpath, mode, metacopy);
+}
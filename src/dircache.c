@@ -0,0 +1,219 @@
+/* ============================================================
+   PrismaFS - dircache.c
+   Merged directory listings and their cache
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+
+/* -------------------------------------------------------------
+   dirlist = result of merging one directory across all layers
+   (name, inode, d_type per entry). once built it is never modified,
+   so it can be shared: the cache and every reader hold a reference.
+
+   dircache keeps merged listings keyed by virtual dir path. build
+   systems, find and IDE indexers list the same unchanged dirs over and
+   over, a hit costs one hash lookup instead of a multi-layer merge.
+
+   only safe when nothing changes behind our back:
+   - every base layer must be marked "readonly" in config
+   - session layer is only modified through the mount, and every
+     mutating op calls invalidate_path()/invalidate_all()
+   -------------------------------------------------------------
+*/
+
+#define DIRLIST_INITIAL_CAP 64
+
+size_t dircache_slots = 0; // cached dirs, 0 = disabled
+
+struct dircache_entry {
+    uint64_t hash;
+    char *path;             // owned copy of virtual dir path, NULL = empty
+    struct dirlist *list;   // holds one reference
+};
+
+static struct dircache_entry *dircache_table = NULL;
+static size_t dircache_mask;
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dircache_gen = 0; // bumped by every invalidation
+
+struct dirlist *dirlist_new(void)
+{
+    struct dirlist *dl = calloc(1, sizeof(*dl));
+    if (dl)
+        dl->refs = 1;
+    return dl;
+}
+
+// appends entry, name is copied into the list arena
+int dirlist_append(struct dirlist *dl, const char *name, ino_t ino, unsigned char type,
+                   int layer)
+{
+    if (dl->count == dl->cap) {
+        size_t cap = dl->cap ? dl->cap * 2 : DIRLIST_INITIAL_CAP;
+        struct dirlist_entry *e = realloc(dl->entries, cap * sizeof(*e));
+        if (!e)
+            return -ENOMEM;
+        dl->entries = e;
+        dl->cap = cap;
+    }
+
+    const char *copy = arena_strdup(&dl->arena, name, strlen(name));
+    if (!copy)
+        return -ENOMEM;
+
+    struct dirlist_entry *e = &dl->entries[dl->count++];
+    e->name = copy;
+    e->ino = ino;
+    e->type = type;
+    e->layer = layer;
+    return 0;
+}
+
+void dirlist_get(struct dirlist *dl)
+{
+    __atomic_add_fetch(&dl->refs, 1, __ATOMIC_RELAXED);
+}
+
+// drops a reference, last one frees entries and all names at once
+void dirlist_put(struct dirlist *dl)
+{
+    if (!dl || __atomic_sub_fetch(&dl->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    free(dl->entries);
+    arena_free(&dl->arena);
+    free(dl);
+}
+
+void dircache_init(void)
+{
+    if (dircache_slots == 0)
+        return;
+
+    // a listing of a mutable base layer could go stale without us knowing
+    if (!all_base_readonly()) {
+        fprintf(stderr, "prismafs: dircache disabled, not every base layer is readonly\n");
+        return;
+    }
+
+    size_t n = 1;
+    while (n < dircache_slots)
+        n <<= 1;
+
+    dircache_table = calloc(n, sizeof(struct dircache_entry));
+    if (!dircache_table) {
+        fprintf(stderr, "prismafs: dircache disabled, out of memory\n");
+        return;
+    }
+    dircache_mask = n - 1;
+}
+
+// returns referenced listing for dir path, or NULL on miss
+struct dirlist *dircache_get(const char *path)
+{
+    if (!dircache_table)
+        return NULL;
+
+    uint64_t h = path_hash(path);
+    struct dircache_entry *e = &dircache_table[h & dircache_mask];
+    struct dirlist *dl = NULL;
+
+    pthread_mutex_lock(&dircache_lock);
+    if (e->path && e->hash == h && strcmp(e->path, path) == 0) {
+        dl = e->list;
+        dirlist_get(dl);
+    }
+    pthread_mutex_unlock(&dircache_lock);
+
+    return dl;
+}
+
+/* generation before a merge starts. if anything gets invalidated while
+   merging, the listing may already be stale and dircache_store drops it */
+uint64_t dircache_generation(void)
+{
+    return __atomic_load_n(&dircache_gen, __ATOMIC_ACQUIRE);
+}
+
+// stores listing for dir path, cache takes its own reference
+void dircache_store(const char *path, struct dirlist *dl, uint64_t gen)
+{
+    if (!dircache_table)
+        return;
+
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+
+    uint64_t h = path_hash(path);
+    struct dircache_entry *e = &dircache_table[h & dircache_mask];
+    struct dirlist *old;
+    char *old_path;
+
+    pthread_mutex_lock(&dircache_lock);
+    if (gen != dircache_gen) {
+        pthread_mutex_unlock(&dircache_lock);
+        free(copy);
+        return;
+    }
+
+    dirlist_get(dl);
+    old = e->list;
+    old_path = e->path;
+    e->hash = h;
+    e->path = copy;
+    e->list = dl;
+    pthread_mutex_unlock(&dircache_lock);
+
+    // free outside the lock, a big listing takes a while
+    free(old_path);
+    dirlist_put(old);
+}
+
+void dircache_invalidate(const char *path)
+{
+    if (!dircache_table)
+        return;
+
+    uint64_t h = path_hash(path);
+    struct dircache_entry *e = &dircache_table[h & dircache_mask];
+    struct dirlist *old = NULL;
+    char *old_path = NULL;
+
+    pthread_mutex_lock(&dircache_lock);
+    __atomic_add_fetch(&dircache_gen, 1, __ATOMIC_RELEASE);
+    if (e->path && e->hash == h && strcmp(e->path, path) == 0) {
+        old = e->list;
+        old_path = e->path;
+        e->list = NULL;
+        e->path = NULL;
+    }
+    pthread_mutex_unlock(&dircache_lock);
+
+    free(old_path);
+    dirlist_put(old);
+}
+
+void dircache_flush(void)
+{
+    if (!dircache_table)
+        return;
+
+    pthread_mutex_lock(&dircache_lock);
+    __atomic_add_fetch(&dircache_gen, 1, __ATOMIC_RELEASE);
+    for (size_t slot = 0; slot <= dircache_mask; slot++) {
+        struct dircache_entry *e = &dircache_table[slot];
+        free(e->path);
+        dirlist_put(e->list);
+        e->path = NULL;
+        e->list = NULL;
+    }
+    pthread_mutex_unlock(&dircache_lock);
+}
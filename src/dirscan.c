@@ -0,0 +1,127 @@
+/* ============================================================
+   PrismaFS - dirscan.c
+   Bulk directory scanning for the layer merge
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* -------------------------------------------------------------
+   readdir(3) fills a small buffer inside the DIR (32 KiB in glibc) and
+   hands out one dirent per call. merging a 100k entry dir from several
+   layers is then many getdents64 syscalls plus a function call and copy
+   per entry.
+
+   on Linux dir_scan() calls getdents64 directly into a large buffer
+   owned by the calling thread and reused for every scan, and passes
+   each record's name to the callback in place. nothing is copied until
+   the caller decides to keep a name (nameset / dirlist arenas).
+   elsewhere it falls back to readdir.
+   -------------------------------------------------------------
+*/
+
+#ifdef __linux__
+#define SCAN_BUF_SIZE (256 * 1024)
+
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static pthread_key_t scan_key;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static __thread char *scan_buf = NULL;
+
+static void scan_key_init(void)
+{
+    pthread_key_create(&scan_key, free); // buffer goes with its thread
+}
+
+// buffer of the calling thread, NULL = out of memory
+static char *scan_buffer(void)
+{
+    if (scan_buf)
+        return scan_buf;
+
+    pthread_once(&scan_once, scan_key_init);
+    scan_buf = malloc(SCAN_BUF_SIZE);
+    if (scan_buf)
+        pthread_setspecific(scan_key, scan_buf);
+    return scan_buf;
+}
+#endif
+
+/* calls fn for every entry of dir "rel" below dirfd, "." and ".."
+   included. stops early when fn returns non-zero and returns that.
+   -1 with errno set when the dir cant be opened or read.
+   name is only valid during the call, fn must not dir_scan() itself */
+int dir_scan(int dirfd, const char *rel, dir_scan_fn fn, void *arg)
+{
+    int fd = openat(dirfd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+#ifdef __linux__
+    char *buf = scan_buffer();
+    if (!buf) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, SCAN_BUF_SIZE);
+        if (n <= 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return n == 0 ? 0 : -1;
+        }
+
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *de = (struct linux_dirent64 *)(buf + pos);
+            int res = fn(de->d_name, de->d_ino, de->d_type, arg);
+            if (res != 0) {
+                close(fd);
+                return res;
+            }
+            pos += de->d_reclen;
+        }
+    }
+#else
+    DIR *dp = fdopendir(fd);
+    if (!dp) {
+        close(fd);
+        return -1;
+    }
+
+    struct dirent *de;
+    int res = 0;
+    while (res == 0 && (de = readdir(dp)) != NULL)
+        res = fn(de->d_name, de->d_ino, de->d_type, arg);
+    closedir(dp);
+    return res;
+#endif
+}
+
+/* dir_scan() or manifest_scan() result as 0 or -errno. a layer where the
+   dir is missing or not a dir adds nothing, that is not an error.
+   callbacks return a positive errno to stop a scan */
+int dir_scan_error(int res)
+{
+    if (res == -1)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -errno;
+    return -res;
+}
@@ -0,0 +1,265 @@
+/* ============================================================
+   PrismaFS - layerindex.c
+   Which base layer owns a name, per directory
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+
+/* -------------------------------------------------------------
+   resolving a name walks the base layers in order, one fstatat per
+   layer until one has it. with 100 package layers a miss is 100
+   syscalls, and a hit in a low layer nearly as many.
+
+   the owner index reads a directory once in every base layer and
+   remembers, for each name, the first layer that has it. after that a
+   lookup in that dir is one hash probe, no matter how many layers.
+
+   base layers are only ever read once the index exists, so this is
+   only done when every base layer is "readonly". the session layer
+   (and its whiteouts) is still checked first by the caller, as before.
+
+   table is direct mapped by dir path like the lookup cache, a dir
+   colliding with another replaces it and gets rebuilt when needed.
+   a dir index never changes once built and is reference counted, the
+   low-level backend keeps one on each dir node and asks it directly.
+   -------------------------------------------------------------
+*/
+
+#define INDEX_STRIPES    64
+#define INDEX_INITIAL    16   // name slots of a new dir index, power of 2
+
+struct owner_slot {
+    uint64_t hash;
+    const char *name;          // in arena, NULL = empty
+    int layer;
+};
+
+struct owner_dir {
+    int refs;                  // table slot and every holder, atomic
+    uint64_t hash;             // of virtual dir path
+    char *path;
+    struct owner_slot *slots;
+    size_t cap;                // power of 2
+    size_t count;
+    struct name_arena arena;
+};
+
+size_t layer_index_slots = 4096; // dirs kept, 0 = disabled
+
+static struct owner_dir **index_table = NULL;
+static size_t index_mask;
+static pthread_mutex_t index_locks[INDEX_STRIPES];
+
+void layer_index_init(void)
+{
+    if (!all_base_readonly())
+        layer_index_slots = 0; // mutable base layer could gain/lose names behind our back
+    if (layer_index_slots == 0)
+        return;
+
+    size_t n = 1;
+    while (n < layer_index_slots)
+        n <<= 1;
+
+    index_table = calloc(n, sizeof(*index_table));
+    if (!index_table) {
+        fprintf(stderr, "prismafs: layer index disabled, out of memory\n");
+        layer_index_slots = 0;
+        return;
+    }
+    index_mask = n - 1;
+
+    for (int i = 0; i < INDEX_STRIPES; i++)
+        pthread_mutex_init(&index_locks[i], NULL);
+}
+
+static void owner_dir_free(struct owner_dir *d)
+{
+    if (!d)
+        return;
+    free(d->path);
+    free(d->slots);
+    arena_free(&d->arena);
+    free(d);
+}
+
+// slot holding name, or the empty one where it would go
+static struct owner_slot *owner_slot(const struct owner_dir *d, const char *name, uint64_t h)
+{
+    size_t i = h & (d->cap - 1);
+
+    while (d->slots[i].name) {
+        if (d->slots[i].hash == h && strcmp(d->slots[i].name, name) == 0)
+            break;
+        i = (i + 1) & (d->cap - 1);
+    }
+    return &d->slots[i];
+}
+
+static int owner_grow(struct owner_dir *d)
+{
+    size_t cap = d->cap * 2;
+    struct owner_slot *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+        return -1;
+
+    for (size_t i = 0; i < d->cap; i++) {
+        if (!d->slots[i].name)
+            continue;
+        size_t j = d->slots[i].hash & (cap - 1);
+        while (slots[j].name)
+            j = (j + 1) & (cap - 1);
+        slots[j] = d->slots[i];
+    }
+    free(d->slots);
+    d->slots = slots;
+    d->cap = cap;
+    return 0;
+}
+
+// first layer to add a name owns it, later ones are shadowed
+static int owner_add(struct owner_dir *d, const char *name, int layer)
+{
+    if ((d->count + 1) * 10 > d->cap * 7 && owner_grow(d) != 0)
+        return -1;
+
+    uint64_t h = path_hash(name);
+    struct owner_slot *s = owner_slot(d, name, h);
+    if (s->name)
+        return 0;
+
+    if (!(s->name = arena_strdup(&d->arena, name, strlen(name))))
+        return -1;
+    s->hash = h;
+    s->layer = layer;
+    d->count++;
+    return 0;
+}
+
+struct owner_scan {
+    struct owner_dir *d;
+    int layer;
+};
+
+static int owner_scan_entry(const char *name, ino_t ino, unsigned char type, void *arg)
+{
+    struct owner_scan *os = arg;
+    (void) ino;
+    (void) type;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+    return owner_add(os->d, name, os->layer) != 0 ? ENOMEM : 0;
+}
+
+/* reads dir in every base layer. NULL when any layer cant be read (or
+   out of memory): an index missing that layer's names would answer
+   RESOLVE_ENOENT for them until unmount, without one lookups walk */
+static struct owner_dir *owner_build(const char *dir, uint64_t h)
+{
+    struct owner_dir *d = calloc(1, sizeof(*d));
+    if (!d || !(d->path = strdup(dir)) ||
+        !(d->slots = calloc(INDEX_INITIAL, sizeof(*d->slots)))) {
+        owner_dir_free(d);
+        return NULL;
+    }
+    d->hash = h;
+    d->cap = INDEX_INITIAL;
+
+    const char *rel = layer_relpath(dir);
+    struct owner_scan os = { d, 0 };
+    for (os.layer = 0; os.layer < num_base_layers; os.layer++) {
+        struct manifest *m = base_manifests[os.layer];
+
+        // a layer where dir is missing or not a dir simply adds nothing
+        int res = m ? manifest_scan(m, dir, owner_scan_entry, &os)
+                    : dir_scan(base_root_fds[os.layer], rel, owner_scan_entry, &os);
+        if (dir_scan_error(res) != 0) {
+            owner_dir_free(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+void layer_index_put(struct owner_dir *d)
+{
+    if (d && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        owner_dir_free(d);
+}
+
+/* index of virtual dir "dir" with a reference for the caller, built on a
+   miss. NULL when there is no index to ask */
+struct owner_dir *layer_index_dir(const char *dir)
+{
+    if (!index_table)
+        return NULL;
+
+    uint64_t h = path_hash(dir);
+    size_t slot = h & index_mask;
+    pthread_mutex_t *lock = &index_locks[slot % INDEX_STRIPES];
+    struct owner_dir *d;
+
+    pthread_mutex_lock(lock);
+    d = index_table[slot];
+    if (d && d->hash == h && strcmp(d->path, dir) == 0) {
+        __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(lock);
+        return d;
+    }
+    pthread_mutex_unlock(lock);
+
+    // miss, read the dir in every layer without holding the lock
+    d = owner_build(dir, h);
+    if (!d)
+        return NULL;
+    d->refs = 2; // table and caller
+
+    pthread_mutex_lock(lock);
+    struct owner_dir *old = index_table[slot];
+    index_table[slot] = d;
+    pthread_mutex_unlock(lock);
+
+    layer_index_put(old);
+    return d;
+}
+
+// base layer owning "name" in an index, RESOLVE_ENOENT when no base layer has it
+int layer_index_lookup(const struct owner_dir *d, const char *name)
+{
+    struct owner_slot *s = owner_slot(d, name, path_hash(name));
+    return s->name ? s->layer : RESOLVE_ENOENT;
+}
+
+/* base layer owning "name" in virtual dir "dir", RESOLVE_ENOENT when no
+   base layer has it, OWNER_UNKNOWN when there is no index to ask */
+int layer_index_owner(const char *dir, const char *name)
+{
+    struct owner_dir *d = layer_index_dir(dir);
+    if (!d)
+        return OWNER_UNKNOWN;
+
+    int layer = layer_index_lookup(d, name);
+    layer_index_put(d);
+    return layer;
+}
+
+// same for a full virtual path "/a/b/c" -> dir "/a/b", name "c"
+int layer_index_owner_path(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *name = strrchr(path, '/');
+
+    if (!index_table || !name || !name[1])
+        return OWNER_UNKNOWN; // "/" has no parent to index
+
+    parent_path(dir, path);
+    return layer_index_owner(dir, name + 1);
+}
@@ -10,13 +10,112 @@
  *     http://www.apache.org/licenses/LICENSE-2.0
    ============================================================ */
 #include "prismafs.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>       // FICLONE
+#endif
 
 // multiple base layers can be combined for session view in single mount
-char base_paths[MAX_BASE_LAYERS][PATH_MAX];
-int  num_base_layers = 0;
+char **base_paths = NULL;
+int  *base_flags = NULL;   // LAYER_* bits
+struct manifest **base_manifests = NULL;
+int   num_base_layers = 0;
+static int base_layers_cap = 0;
 
 char session_path[PATH_MAX]; // session layer
 
+/* layer roots opened once at mount. hot ops call *at() relative to
+   these with layer_relpath(path) instead of building an absolute path,
+   so the kernel doesnt walk the layer prefix again on every call. */
+int session_root_fd = -1;
+int *base_root_fds = NULL;
+
+#ifdef O_PATH
+#define LAYER_ROOT_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define LAYER_ROOT_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC) // macOS has no O_PATH
+#endif
+
+/* appends a base layer below the ones added so far (config and
+   BASE_LAYER_DIRS order). 0 = ok, -1 = out of memory */
+int layers_add(const char *path, int flags)
+{
+    if (num_base_layers == base_layers_cap) {
+        int cap = base_layers_cap ? base_layers_cap * 2 : 8;
+        char **paths = realloc(base_paths, cap * sizeof(*paths));
+        if (paths)
+            base_paths = paths;
+        int *fl = realloc(base_flags, cap * sizeof(*fl));
+        if (fl)
+            base_flags = fl;
+        struct manifest **mf = realloc(base_manifests, cap * sizeof(*mf));
+        if (mf)
+            base_manifests = mf;
+        if (!paths || !fl || !mf)
+            return -1;
+        base_layers_cap = cap;
+    }
+
+    char *copy = strdup(path);
+    if (!copy)
+        return -1;
+    base_paths[num_base_layers] = copy;
+    base_flags[num_base_layers] = flags;
+    base_manifests[num_base_layers] = NULL;
+    num_base_layers++;
+    return 0;
+}
+
+/* must run before FUSE starts serving requests.
+   0 = ok, -1 = session layer cant be opened. missing base layer only warns */
+int layers_open(void)
+{
+    session_root_fd = open(session_path, LAYER_ROOT_FLAGS);
+    if (session_root_fd == -1) {
+        fprintf(stderr, "prismafs: cannot open session layer %s: %s\n",
+                session_path, strerror(errno));
+        return -1;
+    }
+
+    base_root_fds = malloc((num_base_layers + 1) * sizeof(*base_root_fds));
+    if (!base_root_fds) {
+        fprintf(stderr, "prismafs: out of memory opening base layers\n");
+        return -1;
+    }
+
+    for (int i = 0; i < num_base_layers; i++) {
+        base_root_fds[i] = open(base_paths[i], LAYER_ROOT_FLAGS);
+        if (base_root_fds[i] == -1)
+            fprintf(stderr, "prismafs: cannot open base layer %s: %s\n",
+                    base_paths[i], strerror(errno));
+    }
+    return 0;
+}
+
+// virtual path relative to a layer root: "/a/b" -> "a/b", "/" -> "."
+const char *layer_relpath(const char *path)
+{
+    while (*path == '/')
+        path++;
+    return *path ? path : ".";
+}
+
+// 1 when every base layer is marked readonly, nothing changes behind our back
+int all_base_readonly(void)
+{
+    for (int i = 0; i < num_base_layers; i++)
+        if (!(base_flags[i] & LAYER_READONLY))
+            return 0;
+    return 1;
+}
+
+// root fd of RESOLVE_SESSION or a base layer index
+int layer_root_fd(int layer)
+{
+    return layer >= 0 ? base_root_fds[layer] : session_root_fd;
+}
+
 // helper func to construct full path in the session layer
 void session_fullpath(char fpath[PATH_MAX], const char *path)
 {
@@ -29,67 +128,152 @@ void session_fullpath(char fpath[PATH_MAX], const char *path)
         snprintf(fpath, PATH_MAX, "%s%s", session_path, path);
 }
 
+// helper func to construct full path in base layer number "layer"
+void base_layer_fullpath(char fpath[PATH_MAX], int layer, const char *path)
+{
+    // avoid double slash on joining base and file path
+    if (base_paths[layer][strlen(base_paths[layer]) - 1] == '/' && path[0] == '/')
+        snprintf(fpath, PATH_MAX, "%s%s", base_paths[layer], path + 1);
+    else
+        snprintf(fpath, PATH_MAX, "%s%s", base_paths[layer], path);
+}
+
+// first base layer holding path, -1 = not in any. for *at() calls on base_root_fds
+int base_layer_of(const char *path)
+{
+    const char *rel = layer_relpath(path);
+
+    for (int i = 0; i < num_base_layers; i++) {
+        // check if the file actually exists at this location (manifest knows without asking)
+        if (base_manifests[i] ? manifest_find(base_manifests[i], path) != NULL
+                              : faccessat(base_root_fds[i], rel, F_OK, 0) == 0)
+            return i;
+    }
+    return -1;
+}
+
 // walks through all base layers in order and builds the full path to the file.
 // returns 0 and fills fpath if the file is found in any base layer, -1 if not found in any.
 int base_fullpath_func(char fpath[PATH_MAX], const char *path) {
-    for (int i = 0; i < num_base_layers; i++) {
-        // avoid double slash on joining base and file path
-        if (base_paths[i][strlen(base_paths[i]) - 1] == '/' && path[0] == '/')
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path + 1);
-        else
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path);
-
-        // check if the file actually exists at this location
-        if (access(fpath, F_OK) == 0) {
-            return 0; // found it, fpath is now set to the real location
-        }
-    }
-    return -1; // not found in any base layer
+    int layer = base_layer_of(path);
+
+    if (layer == -1)
+        return -1; // not found in any base layer
+    base_layer_fullpath(fpath, layer, path);
+    return 0; // found it, fpath is now set to the real location
 }
 
-// helper func for checking if filename is in linked list
-int is_in_list(struct filename_node *filename_list, const char *name) {
-    struct filename_node *current = filename_list;
+/* parent dir of a virtual path in session, created if missing. one level
+   only, same as every op did inline before. root always exists.
+   0 or -errno, most callers let the op itself fail instead */
+int session_mkparent(const char *path)
+{
+    char parent[PATH_MAX];
 
-    // walking linked list
-    // [node1] -> [node2] -> [node3] -> NULL
-    //  "foo"      "bar"      "baz"
-    /*
-    current starts at first node - strcmp compares node name to what its looking for (return 0 when strings are equal)
-    if match then return 1, if no match then move to the next node
-    when current is at the end of list (NULL), exit loop, func returns 0 (not found)
-    */
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0)
-            return 1;
-        current = current->next;
-    }
+    parent_path(parent, path);
+    if (strcmp(parent, "/") != 0 &&
+        mkdirat(session_root_fd, layer_relpath(parent), 0755) == -1 && errno != EEXIST)
+        return -errno;
     return 0;
 }
 
-// helper to add filename to linked list
-void add_to_list(struct filename_node **filename_list_ptr, const char *name) {
-    // memory chunk for filename_node struct, malloc returns pointer to allocated memory, if NULL then allocation failed
-    struct filename_node *new_node = malloc(sizeof(struct filename_node));
-    // safeguard check just in case malloc fails
-    if (new_node == NULL) {
-        perror("malloc");
-        return;
-    }
+// "<path>.deleted" marker in session, masks path in every base layer
+int whiteout_create(const char *path)
+{
+    char marker[PATH_MAX];
 
-    // make owned copy of filename string for this node to keep
-    // if that copy failed, free the node and return
-    new_node->name = strdup(name);
-    if (new_node->name == NULL) {
-        perror("strdup");
-        free(new_node);
-        return;
-    }
+    if (snprintf(marker, PATH_MAX, "%s.deleted", layer_relpath(path)) >= PATH_MAX)
+        return -ENAMETOOLONG;
+
+    int fd = openat(session_root_fd, marker, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -errno;
+    close(fd);
+    return 0;
+}
+
+/* -------------------------------------------------
+copy-up methods, fastest first. each one that isnt supported by the
+filesystems involved falls through to the next:
+
+ - FICLONE reflink (btrfs, xfs, same fs): shares extents, O(1) no matter the size
+ - copy_file_range: kernel copies in-kernel, server side on NFS, may reflink too
+ - sendfile: in-kernel copy for older kernels
+ - read/write loop with a big buffer: works everywhere
+
+which method did the copy is counted in cow_stats. sparse and metacopy
+copy-ups (cowmap.c) count under "sparse", with the blocks they fill later.
+-------------------------------------------------
+*/
+struct cow_stats cow_stats;
+
+#define COW_BUF_SIZE (1024 * 1024) // userspace fallback chunk
+
+void cow_count(int method, uint64_t count, off_t bytes)
+{
+    __atomic_add_fetch(&cow_stats.count[method], count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cow_stats.bytes[method], (uint64_t)bytes, __ATOMIC_RELAXED);
+}
 
-    new_node->next = *filename_list_ptr;
-    *filename_list_ptr = new_node;
+const char *cow_method_name(int method)
+{
+    static const char *names[COW_METHODS] = {
+        "reflink", "copy_file_range", "sendfile", "readwrite", "sparse"
+    };
+    return names[method];
 }
 
+/* copies src_fd into dst_fd from offset *done up to size.
+   returns 0 when done (or method unsupported, *done tells how far it
+   got), -errno on real error. */
+#ifdef __linux__
+// errno values meaning "this method doesnt work here, try next one"
+static int cow_unsupported(int err)
+{
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP ||
+           err == EINVAL || err == ENOTTY || err == EBADF;
+}
+
+static int cow_copy_file_range(int src_fd, int dst_fd, off_t size, off_t *done)
+{
+    while (*done < size) {
+        loff_t in_off = *done, out_off = *done;
+        ssize_t n = copy_file_range(src_fd, &in_off, dst_fd, &out_off,
+                                    (size_t)(size - *done), 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return cow_unsupported(errno) ? 0 : -errno;
+        }
+        if (n == 0)
+            break; // source shrank
+        *done += n;
+    }
+    return 0;
+}
+
+static int cow_sendfile(int src_fd, int dst_fd, off_t size, off_t *done)
+{
+    // sendfile writes at the current file offset of dst
+    if (lseek(dst_fd, *done, SEEK_SET) == -1)
+        return -errno;
+
+    while (*done < size) {
+        off_t in_off = *done;
+        size_t chunk = size - *done > 0x7ffff000 ? 0x7ffff000 : (size_t)(size - *done);
+        ssize_t n = sendfile(dst_fd, src_fd, &in_off, chunk);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return cow_unsupported(errno) ? 0 : -errno;
+        }
+        if (n == 0)
+            break;
+        *done += n;
+    }
+    return 0;
+}
+#endif
 
 /* 
 -------------------------------------------------
@@ -99,9 +283,118 @@ it would appear to succeed without error but it would be corrupted.
 
 nw != nr catches incomplete writes and errors and unlink() any corruption left in session
 -------------------------------------------------
+*/
+static int cow_readwrite(int src_fd, int dst_fd, off_t *done)
+{
+    char *buf = malloc(COW_BUF_SIZE);
+    if (!buf)
+        return -ENOMEM;
+
+    ssize_t nr, nw; // bytes read and bytes written
+    int ret = 0;
+
+    // read until EOF, also picks up anything appended since fstat
+    while ((nr = pread(src_fd, buf, COW_BUF_SIZE, *done)) > 0) {
+        nw = pwrite(dst_fd, buf, (size_t)nr, *done);
+        if (nw != nr) {
+           // if write returned less bytes than expected theres disk issue
+           // so should break with error 
+            ret = -EIO;
+            break;
+        }
+        *done += nr;
+    }
+    if (nr == -1)
+        ret = -errno; // read fail
+
+    free(buf);
+    return ret;
+}
+
+/* -------------------------------------------------
+copy-up locks. FUSE runs ops on many threads, two first writes to the
+same base file would both see "not in session yet" and both copy it,
+the second copy wiping what the first writer already wrote.
+
+copy-up of one session path is serialized by a mutex picked by hash of
+the path (sharded, so unrelated copy-ups rarely wait on each other).
+whoever gets the lock second finds the session copy and uses it.
+-------------------------------------------------
+*/
+#define COPYUP_STRIPES 256
 
+static pthread_mutex_t copyup_locks[COPYUP_STRIPES];
+static pthread_once_t copyup_once = PTHREAD_ONCE_INIT;
+static pthread_rwlock_t copyup_gate = PTHREAD_RWLOCK_INITIALIZER; // shared by every copy-up
+
+static void copyup_locks_init(void)
+{
+    for (int i = 0; i < COPYUP_STRIPES; i++)
+        pthread_mutex_init(&copyup_locks[i], NULL);
+}
+
+static pthread_mutex_t *copyup_lock_for(const char *session_fpath)
+{
+    pthread_once(&copyup_once, copyup_locks_init);
+    return &copyup_locks[path_hash(session_fpath) % COPYUP_STRIPES];
+}
+
+void copyup_lock(const char *session_fpath)
+{
+    pthread_rwlock_rdlock(&copyup_gate);
+    pthread_mutex_lock(copyup_lock_for(session_fpath));
+}
+
+void copyup_unlock(const char *session_fpath)
+{
+    pthread_mutex_unlock(copyup_lock_for(session_fpath));
+    pthread_rwlock_unlock(&copyup_gate);
+}
+
+/* waits out every running copy-up and keeps new ones from starting.
+   whoever creates a .cowtmp. file holds copyup_lock() of its target until
+   the file is renamed or removed, so one seen while holding this belongs
+   to no running copy-up: a crash leftover */
+void copyup_lock_all(void)
+{
+    pthread_rwlock_wrlock(&copyup_gate);
+}
+
+void copyup_unlock_all(void)
+{
+    pthread_rwlock_unlock(&copyup_gate);
+}
+
+/* creates "<dir of dst>/.cowtmp.XXXXXX" for building a copy that gets
+   renamed over dst. dot name = never listed by readdir. */
+int cow_tmpfile(char tmp[PATH_MAX], const char *dst, mode_t mode)
+{
+    const char *slash = strrchr(dst, '/');
+    int dir_len = slash ? (int)(slash - dst + 1) : 0;
+
+    if (snprintf(tmp, PATH_MAX, "%.*s" COW_TMP_PREFIX "XXXXXX", dir_len, dst) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return -1;
+
+    // mkstemp always makes 0600
+    if (fchmod(fd, mode) == -1) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
 - copies file from src to destination (dst) with given mode.
-- check write() return on each chunk, if failure ,remove partial dest
+- check every chunk, if failure ,remove partial dest
 - so no corrupt half-written file is left in the session layer.
 - 0 = success, -errno = failure. */
 int cow_file(const char *src, const char *dst, mode_t mode)
@@ -112,10 +405,18 @@ int cow_file(const char *src, const char *dst, mode_t mode)
     if (src_fd == -1)
         return -errno;
 
-    // open dest file for writing
-    // O_CREAT = create if doesnt exist, O_TRUNC = if exists, wipe
-    // "mode" is file permissions 
-    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    struct stat st;
+    if (fstat(src_fd, &st) == -1) {
+        int err = errno;
+        close(src_fd);
+        return -err;
+    }
+
+    /* copy goes into a temp file next to dst and is renamed over it at
+       the end, so nobody opening dst meanwhile sees a half copied file
+       "mode" is file permissions */
+    char tmp[PATH_MAX];
+    int dst_fd = cow_tmpfile(tmp, dst, mode);
 
     if (dst_fd == -1) {
         int err = errno;
@@ -123,30 +424,52 @@ int cow_file(const char *src, const char *dst, mode_t mode)
         return -err;
     }
 
-    char buf[8192]; // chunked 8kb buffer
-    ssize_t nr, nw; // bytes read and bytes written
-    int ret = 0; // ret != 0 for error
+    off_t done = 0;  // bytes copied so far
+    int method = COW_READWRITE;
+    int ret = 0;     // ret != 0 for error
 
-    // read...
-    while ((nr = read(src_fd, buf, sizeof(buf))) > 0) {
-        nw = write(dst_fd, buf, (size_t)nr);
-        if (nw != nr) {
-           // if write returned less bytes than expected theres disk issue
-           // so should break with error 
-            ret = -EIO;
-            break;
-        }
+#ifdef __linux__
+#ifdef FICLONE
+    // reflink: whole file or nothing
+    if (st.st_size > 0 && ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        done = st.st_size;
+        method = COW_REFLINK;
+    }
+#endif
+    if (ret == 0 && done < st.st_size) {
+        off_t before = done;
+        ret = cow_copy_file_range(src_fd, dst_fd, st.st_size, &done);
+        if (done > before)
+            method = COW_COPY_FILE_RANGE;
+    }
+    if (ret == 0 && done < st.st_size) {
+        off_t before = done;
+        ret = cow_sendfile(src_fd, dst_fd, st.st_size, &done);
+        if (done > before)
+            method = COW_SENDFILE;
+    }
+#endif
+    // whatever is left (or everything when the kernel couldnt help)
+    if (ret == 0) {
+        off_t before = done;
+        ret = cow_readwrite(src_fd, dst_fd, &done);
+        if (done > before && before < st.st_size)
+            method = COW_READWRITE;
     }
-    if (nr == -1)
-        ret = -errno; // read fail
 
     close(src_fd);
     close(dst_fd);
 
-    if (ret != 0)
-        unlink(dst); // design decision = delete incomplete or corrupt content
+    if (ret == 0 && rename(tmp, dst) == -1)
+        ret = -errno;
 
-    return ret;
+    if (ret != 0) {
+        unlink(tmp); // design decision = delete incomplete or corrupt content
+        return ret;
+    }
+
+    cow_count(method, 1, done);
+    return 0;
 }
 
 /* copies all extended attributes (regular files, directories, symlinks) from src to dest
@@ -0,0 +1,1134 @@
+/* ============================================================
+   PrismaFS - lowlevel.c
+   Inode based backend on the libfuse low-level API (Linux)
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+
+#ifdef __linux__
+#include <fuse_lowlevel.h>
+
+/* -------------------------------------------------------------
+   with the high-level API libfuse builds the full path string for every
+   request and we turn it into a full real path per layer, so the kernel
+   walks the whole tree again for every lookup. "backend lowlevel" uses
+   fuse_lowlevel_ops instead:
+
+   - every inode the kernel knows is an ll_node (parent + name)
+   - directory nodes keep O_PATH fds of that directory in session and in
+     every base layer where it exists
+   - lookup/getattr are fstatat() relative to the parent dir fds, so a
+     lookup costs one or two syscalls no matter how deep the tree is
+   - a dir node also keeps its virtual path and owner index once asked
+     for, so indexed and manifest layers are answered from memory
+     without rebuilding the path per lookup
+
+   everything else (open, write, copy-up, rename, xattrs...) is rare in
+   comparison and goes through the same myfs_* functions as the
+   high-level backend, with the path rebuilt from the node chain. that
+   keeps whiteout/copy-up logic in one place.
+
+   dir fds go stale when layers change under them. they are reopened
+   lazily: all of them when namespace_gen moves (dir renamed/removed),
+   a missing session fd when entry_gen moves (copy-up may have created
+   the dir in session).
+   -------------------------------------------------------------
+*/
+
+#define LL_HASH_BUCKETS 65536
+#define LL_PINNED       UINT64_MAX
+
+struct ll_node {
+    struct ll_node *parent;     // holds a child reference on it, NULL for root
+    struct ll_node *hnext;      // hash chain, (parent, name) -> node
+    char *name;
+    uint64_t generation;
+    uint64_t nlookup;           // kernel references, guarded by ll_lock
+    uint64_t children;          // nodes pointing at this one as parent
+    int hashed;                 // still reachable by (parent, name)
+    int virt;                   // synthetic /dev entry, no layer behind it
+
+    pthread_rwlock_t fds_lock;  // readers use fds, refresh swaps them
+    uint64_t fds_gen;           // namespace_gen fds were opened at
+    uint64_t session_gen;       // entry_gen when session fd was last tried
+    int session_fd;             // O_PATH dir fds, -1 = not a dir there
+    int *base_fds;              // one per base layer
+    char *dir_path;             // virtual path, set on first use until refresh
+    struct owner_dir *owners;   // layer index of this dir, same lifetime
+};
+
+static struct ll_node ll_root;
+static struct ll_node *ll_table[LL_HASH_BUCKETS];
+static pthread_mutex_t ll_lock = PTHREAD_MUTEX_INITIALIZER; // table, names, parents, counts
+static uint64_t ll_generation = 0;
+
+int use_lowlevel = 0;
+
+static struct ll_node *ll_node_of(fuse_ino_t ino)
+{
+    return ino == FUSE_ROOT_ID ? &ll_root : (struct ll_node *)(uintptr_t)ino;
+}
+
+static size_t ll_bucket(const struct ll_node *parent, const char *name)
+{
+    return (path_hash(name) ^ ((uintptr_t)parent * 0x9e3779b97f4a7c15ULL)) % LL_HASH_BUCKETS;
+}
+
+// fds and what was cached along with them
+static void ll_close_fds(struct ll_node *n)
+{
+    if (n->session_fd != -1)
+        close(n->session_fd);
+    n->session_fd = -1;
+    for (int i = 0; i < num_base_layers; i++) {
+        if (n->base_fds[i] != -1)
+            close(n->base_fds[i]);
+        n->base_fds[i] = -1;
+    }
+    free(n->dir_path);
+    n->dir_path = NULL;
+    layer_index_put(n->owners);
+    n->owners = NULL;
+}
+
+// 0 = ok, -1 = out of memory
+static int ll_init_fds(struct ll_node *n)
+{
+    n->base_fds = malloc((num_base_layers + 1) * sizeof(*n->base_fds));
+    if (!n->base_fds)
+        return -1;
+    pthread_rwlock_init(&n->fds_lock, NULL);
+    n->session_fd = -1;
+    for (int i = 0; i < num_base_layers; i++)
+        n->base_fds[i] = -1;
+    return 0;
+}
+
+static void ll_unhash(struct ll_node *n)
+{
+    if (!n->hashed)
+        return;
+
+    struct ll_node **pp = &ll_table[ll_bucket(n->parent, n->name)];
+    while (*pp != n)
+        pp = &(*pp)->hnext;
+    *pp = n->hnext;
+    n->hashed = 0;
+}
+
+// frees nodes nobody refers to anymore, walking up to parents. holds ll_lock
+static void ll_maybe_free(struct ll_node *n)
+{
+    while (n != &ll_root && n->nlookup == 0 && n->children == 0) {
+        struct ll_node *parent = n->parent;
+
+        ll_unhash(n);
+        ll_close_fds(n);
+        pthread_rwlock_destroy(&n->fds_lock);
+        free(n->base_fds);
+        free(n->name);
+        free(n);
+
+        parent->children--;
+        n = parent;
+    }
+}
+
+/* rebuilds virtual path "/a/b/c" of a node for the path based ops.
+   0 = ok, -ENAMETOOLONG */
+static int ll_path(struct ll_node *n, char path[PATH_MAX])
+{
+    char tmp[PATH_MAX];
+    size_t pos = PATH_MAX - 1;
+
+    tmp[pos] = '\0';
+
+    pthread_mutex_lock(&ll_lock);
+    for (; n != &ll_root; n = n->parent) {
+        size_t len = strlen(n->name);
+        if (len + 1 > pos) {
+            pthread_mutex_unlock(&ll_lock);
+            return -ENAMETOOLONG;
+        }
+        pos -= len;
+        memcpy(tmp + pos, n->name, len);
+        tmp[--pos] = '/';
+    }
+    pthread_mutex_unlock(&ll_lock);
+
+    if (pos == PATH_MAX - 1)
+        strcpy(path, "/");
+    else
+        memcpy(path, tmp + pos, PATH_MAX - pos);
+    return 0;
+}
+
+// path of child "name" in dir node parent
+static int ll_child_path(struct ll_node *parent, const char *name, char path[PATH_MAX])
+{
+    int res = ll_path(parent, path);
+    if (res != 0)
+        return res;
+
+    size_t len = strlen(path);
+    if (snprintf(path + len, PATH_MAX - len, "%s%s",
+                 len == 1 ? "" : "/", name) >= (int)(PATH_MAX - len))
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/* parent and a copy of the name of n. the parent gets a child reference,
+   n can be renamed away from it (or forgotten) while the caller uses it.
+   *name = NULL when out of memory, ll_parent_put() either way */
+static struct ll_node *ll_parent_get(struct ll_node *n, char **name)
+{
+    pthread_mutex_lock(&ll_lock);
+    struct ll_node *parent = n->parent;
+    parent->children++;
+    *name = strdup(n->name);
+    pthread_mutex_unlock(&ll_lock);
+    return parent;
+}
+
+static void ll_parent_put(struct ll_node *parent)
+{
+    pthread_mutex_lock(&ll_lock);
+    parent->children--;
+    ll_maybe_free(parent);
+    pthread_mutex_unlock(&ll_lock);
+}
+
+static void ll_dir_release(struct ll_node *n)
+{
+    pthread_rwlock_unlock(&n->fds_lock);
+}
+
+static void ll_dir_acquire(struct ll_node *n);
+
+/* reopens dir fds of n relative to its parent dir fds. whole set when
+   namespace_gen moved, only a missing session fd when entry_gen moved */
+static void ll_dir_refresh(struct ll_node *n)
+{
+    char *name;
+    struct ll_node *parent = ll_parent_get(n, &name);
+
+    if (!name) {
+        ll_parent_put(parent);
+        return;
+    }
+
+    ll_dir_acquire(parent);
+    pthread_rwlock_wrlock(&n->fds_lock);
+
+    uint64_t ns = __atomic_load_n(&namespace_gen, __ATOMIC_ACQUIRE);
+    uint64_t eg = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
+    int flags = O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+    if (n->fds_gen != ns) {
+        ll_close_fds(n);
+        for (int i = 0; i < num_base_layers; i++)
+            if (parent->base_fds[i] != -1)
+                n->base_fds[i] = openat(parent->base_fds[i], name, flags);
+        n->fds_gen = ns;
+        n->session_gen = eg - 1; // force session fd below
+    }
+    if (n->session_fd == -1 && n->session_gen != eg) {
+        if (parent->session_fd != -1)
+            n->session_fd = openat(parent->session_fd, name, flags);
+        n->session_gen = eg;
+    }
+
+    pthread_rwlock_unlock(&n->fds_lock);
+    ll_dir_release(parent);
+    ll_parent_put(parent);
+    free(name);
+}
+
+// returns with n->fds_lock read locked and fds current
+static void ll_dir_acquire(struct ll_node *n)
+{
+    for (;;) {
+        pthread_rwlock_rdlock(&n->fds_lock);
+        if (n->fds_gen == LL_PINNED)
+            return;
+
+        uint64_t ns = __atomic_load_n(&namespace_gen, __ATOMIC_ACQUIRE);
+        uint64_t eg = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
+        if (n->fds_gen == ns && (n->session_fd != -1 || n->session_gen == eg))
+            return;
+
+        pthread_rwlock_unlock(&n->fds_lock);
+        ll_dir_refresh(n);
+    }
+}
+
+/* virtual path of dir node n, built once and kept until its fds are
+   refreshed (a rename moves namespace_gen). caller holds n's fds.
+   NULL when out of memory or too long */
+static const char *ll_dir_path(struct ll_node *n)
+{
+    char *p = __atomic_load_n(&n->dir_path, __ATOMIC_ACQUIRE);
+    char path[PATH_MAX];
+
+    if (p)
+        return p;
+    if (ll_path(n, path) != 0 || !(p = strdup(path)))
+        return NULL;
+
+    // readers share the fds lock, first one to store wins
+    char *expected = NULL;
+    if (!__atomic_compare_exchange_n(&n->dir_path, &expected, p, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(p);
+        p = expected;
+    }
+    return p;
+}
+
+// layer_index_owner() for a child of parent, OWNER_UNKNOWN when not indexed
+static int ll_index_owner(struct ll_node *parent, const char *name)
+{
+    struct owner_dir *d = __atomic_load_n(&parent->owners, __ATOMIC_ACQUIRE);
+
+    if (layer_index_slots == 0)
+        return OWNER_UNKNOWN;
+
+    if (!d) {
+        const char *dir = ll_dir_path(parent);
+        if (!dir || !(d = layer_index_dir(dir)))
+            return OWNER_UNKNOWN;
+
+        struct owner_dir *expected = NULL;
+        if (!__atomic_compare_exchange_n(&parent->owners, &expected, d, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            layer_index_put(d);
+            d = expected;
+        }
+    }
+    return layer_index_lookup(d, name);
+}
+
+/* name in base layer i of dir parent, from the layer's manifest when it
+   has one. caller holds parent fds. 0 or -1 */
+static int ll_stat_layer(struct ll_node *parent, int i, const char *name, struct stat *st)
+{
+    const char *dir;
+
+    if (base_manifests[i] && (dir = ll_dir_path(parent))) {
+        const struct manifest_entry *e = manifest_find_at(base_manifests[i], dir, name);
+        if (!e)
+            return -1;
+        manifest_stat(e, st);
+        return 0;
+    }
+    if (parent->base_fds[i] == -1)
+        return -1;
+    return fstatat(parent->base_fds[i], name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* same resolution order as resolve_path(), one level relative to the
+   parent dir fds: whiteout, session, base layers in priority order.
+   caller holds parent fds. 0 = found (*layer set), -ENOENT */
+static int ll_resolve(struct ll_node *parent, const char *name, struct stat *st, int *layer)
+{
+    if (parent->session_fd != -1) {
+        char marker[NAME_MAX + 16];
+
+        snprintf(marker, sizeof(marker), "%s.deleted", name);
+        if (faccessat(parent->session_fd, marker, F_OK, 0) == 0) {
+            stats_layer_hit(RESOLVE_WHITEOUT);
+            return -ENOENT;
+        }
+        if (fstatat(parent->session_fd, name, st, AT_SYMLINK_NOFOLLOW) == 0) {
+            *layer = RESOLVE_SESSION;
+            stats_layer_hit(*layer);
+            return 0;
+        }
+    }
+
+    // owner index knows the layer, skips the stat in every layer above it
+    int owner = ll_index_owner(parent, name);
+    if (owner == RESOLVE_ENOENT) {
+        stats_layer_hit(owner);
+        return -ENOENT;
+    }
+    if (owner >= 0 && ll_stat_layer(parent, owner, name, st) == 0) {
+        *layer = owner;
+        stats_layer_hit(*layer);
+        return 0;
+    }
+
+    for (int i = 0; i < num_base_layers; i++) {
+        if (ll_stat_layer(parent, i, name, st) == 0) {
+            *layer = i;
+            stats_layer_hit(*layer);
+            return 0;
+        }
+    }
+    stats_layer_hit(RESOLVE_ENOENT);
+    return -ENOENT;
+}
+
+// synthetic entries: "/dev" and everything below it
+static int ll_is_virtual(struct ll_node *parent, const char *name)
+{
+    return parent->virt || (parent == &ll_root && strcmp(name, "dev") == 0);
+}
+
+// attributes of child "name" of parent and layer serving it, 0 or -errno
+static int ll_stat_child(struct ll_node *parent, const char *name, struct stat *st, int *layer)
+{
+    if (ll_is_virtual(parent, name)) {
+        char path[PATH_MAX];
+        int res = ll_child_path(parent, name, path);
+        *layer = RESOLVE_SESSION;
+        return res ? res : myfs_getattr(path, st, NULL);
+    }
+
+    ll_dir_acquire(parent);
+    int res = ll_resolve(parent, name, st, layer);
+    ll_dir_release(parent);
+    return res;
+}
+
+// finds or creates node for (parent, name) and takes one kernel reference
+static struct ll_node *ll_get_child(struct ll_node *parent, const char *name, int virt)
+{
+    size_t b = ll_bucket(parent, name);
+
+    pthread_mutex_lock(&ll_lock);
+    for (struct ll_node *n = ll_table[b]; n; n = n->hnext) {
+        if (n->parent == parent && strcmp(n->name, name) == 0) {
+            n->nlookup++;
+            pthread_mutex_unlock(&ll_lock);
+            return n;
+        }
+    }
+
+    struct ll_node *n = calloc(1, sizeof(*n));
+    if (!n || !(n->name = strdup(name)) || ll_init_fds(n) != 0) {
+        pthread_mutex_unlock(&ll_lock);
+        if (n)
+            free(n->name);
+        free(n);
+        return NULL;
+    }
+
+    n->fds_gen = LL_PINNED - 1; // never matches, first use opens fds
+    n->parent = parent;
+    n->generation = ++ll_generation;
+    n->nlookup = 1;
+    n->virt = virt;
+    n->hashed = 1;
+    n->hnext = ll_table[b];
+    ll_table[b] = n;
+    parent->children++;
+    pthread_mutex_unlock(&ll_lock);
+
+    return n;
+}
+
+// lookup + entry for the reply. 0 or -errno
+static int ll_entry(struct ll_node *parent, const char *name, struct fuse_entry_param *e)
+{
+    int layer;
+
+    memset(e, 0, sizeof(*e));
+
+    int res = ll_stat_child(parent, name, &e->attr, &layer);
+    if (res != 0)
+        return res;
+
+    struct ll_node *n = ll_get_child(parent, name, ll_is_virtual(parent, name));
+    if (!n)
+        return -ENOMEM;
+
+    e->ino = (uintptr_t)n;
+    e->generation = n->generation;
+    // per entry timeouts: long ones for readonly base layers
+    e->attr_timeout = kcache_timeout(layer, kcache.attr_timeout);
+    e->entry_timeout = kcache_timeout(layer, kcache.entry_timeout);
+    return 0;
+}
+
+// name no longer leads to this node (unlink, rmdir, rename over it)
+static void ll_forget_name(struct ll_node *parent, const char *name)
+{
+    size_t b = ll_bucket(parent, name);
+
+    pthread_mutex_lock(&ll_lock);
+    for (struct ll_node *n = ll_table[b]; n; n = n->hnext) {
+        if (n->parent == parent && strcmp(n->name, name) == 0) {
+            ll_unhash(n);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ll_lock);
+}
+
+static void ll_reply_entry(fuse_req_t req, struct ll_node *parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int res = ll_entry(parent, name, &e);
+
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+/* -------------------------------------------------------------
+   inode ops
+   -------------------------------------------------------------
+*/
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OP_STATS(OP_LOOKUP);
+    struct fuse_entry_param e;
+    int res = ll_entry(ll_node_of(parent), name, &e);
+
+    // ino 0 = negative entry, kernel remembers the miss for negative_timeout
+    if (res == -ENOENT && kcache.negative_timeout > 0) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = kcache.negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+    struct ll_node *n = ll_node_of(ino);
+
+    if (n == &ll_root)
+        return;
+
+    pthread_mutex_lock(&ll_lock);
+    n->nlookup -= nlookup < n->nlookup ? nlookup : n->nlookup;
+    ll_maybe_free(n);
+    pthread_mutex_unlock(&ll_lock);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    ll_forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    for (size_t i = 0; i < count; i++)
+        ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_GETATTR);
+    struct ll_node *n = ll_node_of(ino);
+    struct stat st;
+    int res = 1, layer = RESOLVE_SESSION;
+
+    memset(&st, 0, sizeof(st));
+
+    // fstat() of an open file, its name may be unlinked or lead elsewhere by now
+    if (fi && fi->fh)
+        res = handle_getattr(fi, &st);
+
+    if (res <= 0) {
+        // answered by the open file
+    } else if (n == &ll_root) {
+        st.st_mode = S_IFDIR | 0755; // same as myfs_getattr("/")
+        st.st_nlink = 2;
+        res = 0;
+    } else {
+        char *name;
+        struct ll_node *parent = ll_parent_get(n, &name);
+
+        res = name ? ll_stat_child(parent, name, &st, &layer) : -ENOMEM;
+        free(name);
+        ll_parent_put(parent);
+    }
+
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &st, kcache_timeout(layer, kcache.attr_timeout));
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0 && (to_set & FUSE_SET_ATTR_MODE))
+        res = myfs_chmod(path, attr->st_mode, fi);
+
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+        res = myfs_chown(path, uid, gid, fi);
+    }
+
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+        res = myfs_truncate(path, attr->st_size, fi);
+
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec tv[2];
+
+        tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            tv[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            tv[1] = attr->st_mtim;
+
+        res = myfs_utimens(path, tv, fi);
+    }
+
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_getattr(req, ino, fi);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char path[PATH_MAX], buf[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_readlink(path, buf, sizeof(buf));
+
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_readlink(req, buf);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    char path[PATH_MAX];
+    struct ll_node *p = ll_node_of(parent);
+    int res = ll_child_path(p, name, path);
+
+    if (res == 0)
+        res = myfs_mkdir(path, mode);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_reply_entry(req, p, name);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+    char path[PATH_MAX];
+    struct ll_node *p = ll_node_of(parent);
+    int res = ll_child_path(p, name, path);
+
+    if (res == 0)
+        res = myfs_symlink(link, path);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_reply_entry(req, p, name);
+}
+
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int (*op)(const char *))
+{
+    char path[PATH_MAX];
+    struct ll_node *p = ll_node_of(parent);
+    int res = ll_child_path(p, name, path);
+
+    if (res == 0)
+        res = op(path);
+    if (res == 0)
+        ll_forget_name(p, name);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, myfs_unlink);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    ll_remove(req, parent, name, myfs_rmdir);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    struct ll_node *p = ll_node_of(parent), *np = ll_node_of(newparent);
+    uint64_t ns = __atomic_load_n(&namespace_gen, __ATOMIC_ACQUIRE);
+    int res = ll_child_path(p, name, from);
+
+    if (res == 0)
+        res = ll_child_path(np, newname, to);
+    if (res == 0)
+        res = myfs_rename(from, to, flags);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    // moved node keeps its inode number, kernel keeps using it under the new name
+    ll_forget_name(np, newname);
+
+    pthread_mutex_lock(&ll_lock);
+    size_t b = ll_bucket(p, name);
+    struct ll_node *n;
+    for (n = ll_table[b]; n; n = n->hnext)
+        if (n->parent == p && strcmp(n->name, name) == 0)
+            break;
+
+    char *copy = n ? strdup(newname) : NULL;
+    if (n && copy) {
+        ll_unhash(n);
+        free(n->name);
+        n->name = copy;
+        n->parent = np;
+        np->children++;
+        p->children--;
+        n->hashed = 1;
+        b = ll_bucket(np, newname);
+        n->hnext = ll_table[b];
+        ll_table[b] = n;
+        ll_maybe_free(p);
+    } else if (n) {
+        ll_unhash(n); // out of memory, next lookup makes a new node
+    }
+    pthread_mutex_unlock(&ll_lock);
+
+    /* a dir rename moved namespace_gen before the node got its new name,
+       a refresh in between opened the old name and marked the result
+       current. move it again now that parent and name are right */
+    if (__atomic_load_n(&namespace_gen, __ATOMIC_ACQUIRE) != ns)
+        __atomic_add_fetch(&namespace_gen, 1, __ATOMIC_RELEASE);
+
+    fuse_reply_err(req, 0);
+}
+
+/* -------------------------------------------------------------
+   file ops, fi->fh is the same myfs_handle as in the high-level backend
+   -------------------------------------------------------------
+*/
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_open(path, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    // high-level does this through fuse_config, here it is per open
+    if (kcache.kernel_cache)
+        fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    struct ll_node *p = ll_node_of(parent);
+    struct fuse_entry_param e;
+    int res = ll_child_path(p, name, path);
+
+    if (res == 0)
+        res = myfs_create(path, mode, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    res = ll_entry(p, name, &e);
+    if (res != 0) {
+        myfs_release(path, fi);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_create(req, &e, fi);
+}
+
+// same as the high-level path: fd segments, libfuse splices them
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    struct fuse_bufvec *bv = NULL;
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_read_buf(path, &bv, size, off, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+
+    for (size_t i = 0; i < bv->count; i++)
+        if (!(bv->buf[i].flags & FUSE_BUF_IS_FD))
+            free(bv->buf[i].mem);
+    free(bv);
+}
+
+// write_buf replaces write, data can stay in the pipe until it hits the session fd
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                         off_t off, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_write_buf(path, bufv, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    fuse_reply_err(req, -myfs_flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    myfs_release(NULL, fi);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void) ino;
+    fuse_reply_err(req, -myfs_fsync(NULL, datasync, fi));
+}
+
+/* -------------------------------------------------------------
+   directories: opendir takes a snapshot of the merged listing (same
+   merge and dircache as high-level readdir), readdir pages through it
+   by offset, releasedir drops it
+   -------------------------------------------------------------
+*/
+static int ll_collect(void *buf, const char *name, const struct stat *st,
+                      off_t off, enum fuse_fill_dir_flags flags)
+{
+    (void) off;
+    (void) flags;
+
+    struct dirlist *dl = buf;
+    if (dirlist_append(dl, name, st ? st->st_ino : 0, st ? (st->st_mode >> 12) & 017 : DT_UNKNOWN,
+                       RESOLVE_ENOENT) != 0)
+        return 1;
+    return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[PATH_MAX];
+    struct dirlist *dl = dirlist_new();
+    int res = dl ? ll_path(ll_node_of(ino), path) : -ENOMEM;
+
+    if (res == 0)
+        res = myfs_readdir(path, dl, ll_collect, 0, NULL, 0);
+    if (res != 0) {
+        dirlist_put(dl);
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uintptr_t)dl;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    struct dirlist *dl = (struct dirlist *)(uintptr_t)fi->fh;
+    char *buf = malloc(size);
+    size_t used = 0;
+
+    (void) ino;
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // offset of an entry = its index + 1, so readdir can resume anywhere
+    for (size_t i = off; i < dl->count; i++) {
+        struct dirlist_entry *e = &dl->entries[i];
+        struct stat st;
+
+        memset(&st, 0, sizeof(st));
+        st.st_ino = e->ino;
+        st.st_mode = e->type << 12;
+
+        size_t len = fuse_add_direntry(req, buf + used, size - used, e->name, &st, i + 1);
+        if (len > size - used)
+            break; // buffer full
+        used += len;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+/* same pages with a lookup per entry, the kernel then needs no getattr
+   for them. each entry sent with an inode counts as a lookup of it */
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi)
+{
+    struct dirlist *dl = (struct dirlist *)(uintptr_t)fi->fh;
+    struct ll_node *parent = ll_node_of(ino);
+    char *buf = malloc(size);
+    size_t used = 0;
+
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (size_t i = off; i < dl->count; i++) {
+        struct dirlist_entry *d = &dl->entries[i];
+        struct fuse_entry_param e;
+
+        // check room first, a lookup that doesnt fit would leak a reference
+        if (fuse_add_direntry_plus(req, NULL, 0, d->name, NULL, 0) > size - used)
+            break;
+
+        // "." and ".." and entries gone since opendir go without inode, kernel skips them
+        if (strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0 ||
+            ll_entry(parent, d->name, &e) != 0) {
+            memset(&e, 0, sizeof(e));
+            e.attr.st_ino = d->ino;
+            e.attr.st_mode = d->type << 12;
+        }
+        used += fuse_add_direntry_plus(req, buf + used, size - used, d->name, &e, i + 1);
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    dirlist_put((struct dirlist *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+/* -------------------------------------------------------------
+   the rest maps 1:1 onto path ops
+   -------------------------------------------------------------
+*/
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_statfs(path, &st);
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_statfs(req, &st);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    fuse_reply_err(req, res ? -res : -myfs_access(path, mask));
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    fuse_reply_err(req, res ? -res : -myfs_setxattr(path, name, value, size, flags));
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    char path[PATH_MAX];
+    int res = ll_path(ll_node_of(ino), path);
+
+    fuse_reply_err(req, res ? -res : -myfs_removexattr(path, name));
+}
+
+// size 0 = caller asks how big the value is
+static void ll_reply_xattr(fuse_req_t req, int res, const char *buf, size_t size)
+{
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else if (size == 0)
+        fuse_reply_xattr(req, res);
+    else
+        fuse_reply_buf(req, buf, res);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    char path[PATH_MAX];
+    char *buf = size ? malloc(size) : NULL;
+    int res = (size && !buf) ? -ENOMEM : ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_getxattr(path, name, buf, size);
+    ll_reply_xattr(req, res, buf, size);
+    free(buf);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char path[PATH_MAX];
+    char *buf = size ? malloc(size) : NULL;
+    int res = (size && !buf) ? -ENOMEM : ll_path(ll_node_of(ino), path);
+
+    if (res == 0)
+        res = myfs_listxattr(path, buf, size);
+    ll_reply_xattr(req, res, buf, size);
+    free(buf);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+    conn_want(conn);
+}
+
+static const struct fuse_lowlevel_ops ll_oper = {
+    .init         = ll_init,
+    .lookup       = ll_lookup,
+    .forget       = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr      = ll_getattr,
+    .setattr      = ll_setattr,
+    .readlink     = ll_readlink,
+    .mkdir        = ll_mkdir,
+    .symlink      = ll_symlink,
+    .unlink       = ll_unlink,
+    .rmdir        = ll_rmdir,
+    .rename       = ll_rename,
+    .open         = ll_open,
+    .create       = ll_create,
+    .read         = ll_read,
+    .write_buf    = ll_write_buf,
+    .flush        = ll_flush,
+    .release      = ll_release,
+    .fsync        = ll_fsync,
+    .opendir      = ll_opendir,
+    .readdir      = ll_readdir,
+    .readdirplus  = ll_readdirplus,
+    .releasedir   = ll_releasedir,
+    .statfs       = ll_statfs,
+    .access       = ll_access,
+    .setxattr     = ll_setxattr,
+    .getxattr     = ll_getxattr,
+    .listxattr    = ll_listxattr,
+    .removexattr  = ll_removexattr,
+};
+
+// root node = layer root fds from layers_open(), never refreshed or closed
+static int ll_root_init(void)
+{
+    if (ll_init_fds(&ll_root) != 0)
+        return -1;
+    ll_root.name = "";
+    ll_root.nlookup = 1;
+    ll_root.fds_gen = LL_PINNED;
+
+    ll_root.session_fd = session_root_fd;
+    for (int i = 0; i < num_base_layers; i++)
+        ll_root.base_fds[i] = base_root_fds[i];
+    return 0;
+}
+
+// "backend lowlevel": replaces fuse_main(), same command line
+int lowlevel_main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int ret = 1;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto out;
+    }
+    if (opts.show_version) {
+        printf("PrismaFS Version: %s\n", PRISMAFS_VERSION);
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out;
+    }
+    if (!opts.mountpoint) {
+        fprintf(stderr, "prismafs: no mountpoint given\n");
+        goto out;
+    }
+
+    if (ll_root_init() != 0) {
+        fprintf(stderr, "prismafs: out of memory\n");
+        goto out;
+    }
+
+    se = fuse_session_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+    if (!se)
+        goto out;
+
+    if (fuse_set_signal_handlers(se) == 0) {
+        if (fuse_session_mount(se, opts.mountpoint) == 0) {
+            fuse_daemonize(opts.foreground);
+            if (opts.singlethread)
+                ret = fuse_session_loop(se);
+            else
+                ret = fuse_session_loop_mt(se, opts.clone_fd);
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    fuse_session_destroy(se);
+
+out:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret ? 1 : 0;
+}
+
+#endif /* __linux__ */
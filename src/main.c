@@ -16,7 +16,55 @@ static const char *base_path_initial = "/"; // default base layer path fallback
 // parse line format config file.
 // directives (one per line, # for comments):
 //   session <path>   - session layer directory (required once)
-//   base <path>      - base layer directory (required once or more. order = priority)
+//   base <path> [readonly] [index=<file>]
+//                    - base layer directory (required once or more. order = priority)
+//                      readonly = layer never changes while mounted, allows caching listings
+//                      index = manifest from "prismafs index", implies readonly
+//   lookup_ttl <sec> - how long resolved paths stay cached (0 = no cache)
+//   lookup_cache <n> - number of lookup cache slots
+//   negative_ttl <sec>, negative_cache <n>
+//                    - same for paths found in no layer, separate table
+//   dircache <n>     - cache up to n merged directory listings (0 = off)
+//   layer_index <n>  - remember which base layer owns each name for n dirs
+//   merge_threads <n>- threads scanning base layers of a listing (0 = in order)
+//   cow_mode full|sparse
+//                    - sparse = copy-up only copies blocks that get written
+//   cow_block <bytes>- block size for sparse copy-up
+//   metacopy on|off  - chmod/chown/utimens/xattr copy-up leaves data in base
+//   backend highlevel|lowlevel
+//                    - lowlevel = inode based FUSE backend (Linux only)
+//   entry_timeout <sec>, attr_timeout <sec>, negative_timeout <sec>
+//                    - how long the kernel may cache lookups / attributes
+//   readonly_timeout <sec>
+//                    - longer timeouts for entries from readonly base layers
+//   kernel_cache, auto_cache, use_ino on|off
+//                    - FUSE page cache / inode number options
+//   statfs_total session|sum|<bytes>
+//                    - total size reported to df, free space is always the session fs
+//   statfs_ttl <sec> - how long statfs results are reused (0 = always ask)
+// "on"/"yes"/"1" = 1, anything else = 0
+static int config_bool(const char *value)
+{
+    return strcmp(value, "on") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+}
+
+// "500G", "2T", "4096" -> bytes, 0 when not a size
+static uint64_t config_size(const char *value)
+{
+    char *end;
+    uint64_t n = strtoull(value, &end, 10);
+
+    switch (*end) {
+    case 'T': case 't': n <<= 10; // fallthrough
+    case 'G': case 'g': n <<= 10; // fallthrough
+    case 'M': case 'm': n <<= 10; // fallthrough
+    case 'K': case 'k': n <<= 10; end++; break;
+    case '\0': break;
+    default: return 0;
+    }
+    return (*end == '\0' || strcmp(end, "B") == 0 || strcmp(end, "b") == 0) ? n : 0;
+}
+
 static int load_config(const char *config_path)
 {
     FILE *f = fopen(config_path, "r");
@@ -42,12 +90,15 @@ static int load_config(const char *config_path)
         // skip empty lines and comments
         if (*p == '\0' || *p == '#') continue;
 
-        char keyword[16];
+        char keyword[32];
         char value[4096];
-        if (sscanf(p, "%15s %4095s", keyword, value) != 2) {
+        int consumed = 0;
+        if (sscanf(p, "%31s %4095s%n", keyword, value, &consumed) != 2) {
             fprintf(stderr, "prismafs: ignoring malformed config line: %s\n", p);
             continue;
         }
+        // anything after the value = per directive options
+        char *opts = p + consumed;
 
         if (strcmp(keyword, "session") == 0) {
             if (found_session) {
@@ -58,14 +109,91 @@ static int load_config(const char *config_path)
             session_path[PATH_MAX - 1] = '\0';
             found_session = 1;
         } else if (strcmp(keyword, "base") == 0) {
-            if (num_base_layers >= MAX_BASE_LAYERS) {
-                fprintf(stderr, "prismafs: max base layers (%d) reached, ignoring: %s\n",
-                        MAX_BASE_LAYERS, value);
-                continue;
+            int flags = 0;
+            struct manifest *index = NULL;
+
+            for (char *opt = strtok(opts, " \t"); opt; opt = strtok(NULL, " \t")) {
+                if (strcmp(opt, "readonly") == 0)
+                    flags |= LAYER_READONLY;
+                else if (strncmp(opt, "index=", 6) == 0 && (index = manifest_open(opt + 6)))
+                    flags |= LAYER_READONLY; // manifest is a snapshot, layer must not change
+                else if (strncmp(opt, "index=", 6) != 0)
+                    fprintf(stderr, "prismafs: unknown base option '%s', ignoring\n", opt);
+            }
+            if (layers_add(value, flags) != 0) {
+                fprintf(stderr, "prismafs: out of memory adding base layer %s\n", value);
+                fclose(f);
+                return -1;
             }
-            strncpy(base_paths[num_base_layers], value, PATH_MAX - 1);
-            base_paths[num_base_layers][PATH_MAX - 1] = '\0';
-            num_base_layers++;
+            base_manifests[num_base_layers - 1] = index;
+        } else if (strcmp(keyword, "lookup_ttl") == 0) {
+            lookup_ttl = strtod(value, NULL);
+        } else if (strcmp(keyword, "lookup_cache") == 0) {
+            lookup_cache_slots = strtoul(value, NULL, 10);
+        } else if (strcmp(keyword, "negative_ttl") == 0) {
+            negative_ttl = strtod(value, NULL);
+        } else if (strcmp(keyword, "negative_cache") == 0) {
+            negative_cache_slots = strtoul(value, NULL, 10);
+        } else if (strcmp(keyword, "dircache") == 0) {
+            dircache_slots = strtoul(value, NULL, 10);
+        } else if (strcmp(keyword, "layer_index") == 0) {
+            layer_index_slots = strtoul(value, NULL, 10);
+        } else if (strcmp(keyword, "merge_threads") == 0) {
+            merge_threads = atoi(value);
+        } else if (strcmp(keyword, "cow_mode") == 0) {
+            if (strcmp(value, "sparse") == 0)
+                cow_mode = COW_MODE_SPARSE;
+            else if (strcmp(value, "full") == 0)
+                cow_mode = COW_MODE_FULL;
+            else
+                fprintf(stderr, "prismafs: unknown cow_mode '%s', ignoring\n", value);
+        } else if (strcmp(keyword, "cow_block") == 0) {
+            uint64_t block = strtoull(value, NULL, 10);
+            if (block >= 4096)
+                cow_block = block;
+            else
+                fprintf(stderr, "prismafs: cow_block must be at least 4096, ignoring\n");
+        } else if (strcmp(keyword, "metacopy") == 0) {
+            metacopy = config_bool(value);
+        } else if (strcmp(keyword, "entry_timeout") == 0) {
+            kcache.entry_timeout = strtod(value, NULL);
+        } else if (strcmp(keyword, "attr_timeout") == 0) {
+            kcache.attr_timeout = strtod(value, NULL);
+        } else if (strcmp(keyword, "negative_timeout") == 0) {
+            kcache.negative_timeout = strtod(value, NULL);
+        } else if (strcmp(keyword, "readonly_timeout") == 0) {
+            kcache.readonly_timeout = strtod(value, NULL);
+        } else if (strcmp(keyword, "kernel_cache") == 0) {
+            kcache.kernel_cache = config_bool(value);
+        } else if (strcmp(keyword, "auto_cache") == 0) {
+            kcache.auto_cache = config_bool(value);
+        } else if (strcmp(keyword, "use_ino") == 0) {
+            kcache.use_ino = config_bool(value);
+        } else if (strcmp(keyword, "statfs_total") == 0) {
+            if (strcmp(value, "session") == 0) {
+                statfs_total = STATFS_TOTAL_SESSION;
+            } else if (strcmp(value, "sum") == 0) {
+                statfs_total = STATFS_TOTAL_SUM;
+            } else if ((statfs_total_bytes = config_size(value)) != 0) {
+                statfs_total = STATFS_TOTAL_FIXED;
+            } else {
+                fprintf(stderr, "prismafs: bad statfs_total '%s', ignoring\n", value);
+                statfs_total = STATFS_TOTAL_SESSION;
+            }
+        } else if (strcmp(keyword, "statfs_ttl") == 0) {
+            statfs_ttl = strtod(value, NULL);
+        } else if (strcmp(keyword, "backend") == 0) {
+#ifdef __linux__
+            if (strcmp(value, "lowlevel") == 0)
+                use_lowlevel = 1;
+            else if (strcmp(value, "highlevel") == 0)
+                use_lowlevel = 0;
+            else
+                fprintf(stderr, "prismafs: unknown backend '%s', ignoring\n", value);
+#else
+            if (strcmp(value, "highlevel") != 0)
+                fprintf(stderr, "prismafs: backend '%s' is Linux only, using highlevel\n", value);
+#endif
         } else {
             fprintf(stderr, "prismafs: unknown config directive '%s', ignoring\n", keyword);
         }
@@ -204,12 +332,20 @@ static int run_init(void)
 
 // FUSE operations table
 static struct fuse_operations myfs_oper = {
+    .init     = myfs_init,
     .getattr  = myfs_getattr,
+    .opendir  = myfs_opendir,
     .readdir  = myfs_readdir,
+    .releasedir = myfs_releasedir,
     .open     = myfs_open,
     .access   = myfs_access,
     .read     = myfs_read,
+    .read_buf = myfs_read_buf,
     .write    = myfs_write,
+    .write_buf = myfs_write_buf,
+    .flush    = myfs_flush,
+    .release  = myfs_release,
+    .fsync    = myfs_fsync,
     .truncate = myfs_truncate,
     .create   = myfs_create,
     .statfs   = myfs_statfs,
@@ -235,6 +371,15 @@ int main(int argc, char *argv[])
     if (argc > 1 && strcmp(argv[1], "init") == 0)
         return run_init();
 
+    // prismafs index <basedir> [<file>] - write a base layer manifest
+    if (argc > 1 && strcmp(argv[1], "index") == 0) {
+        if (argc < 3 || argc > 4) {
+            fprintf(stderr, "usage: prismafs index <basedir> [<file>]\n");
+            return 1;
+        }
+        return manifest_write(argv[2], argc == 4 ? argv[3] : "prismafs.idx") == 0 ? 0 : 1;
+    }
+
     // POSIX version flag
     if (argc > 1 && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "-V") == 0)) {
         printf("PrismaFS Version: %s\n", PRISMAFS_VERSION);
@@ -244,7 +389,8 @@ int main(int argc, char *argv[])
     // scan argv for -c <configfile> and build a clean argv for fuse_main
     // (FUSE doesn't know about -c and would error on it)
     const char *config_path = NULL;
-    char **fuse_argv = malloc(argc * sizeof(char *));
+    // + 2 for "-o <cache options>" on FUSE2, + 1 for NULL
+    char **fuse_argv = malloc((argc + 3) * sizeof(char *));
     
     if (!fuse_argv) {
         fprintf(stderr, "prismafs: out of memory\n");
@@ -294,21 +440,15 @@ int main(int argc, char *argv[])
                 if (base_dirs) {
                     char *token = strtok(base_dirs, ",");
 
-                    while (token && num_base_layers < MAX_BASE_LAYERS) {
-                        strncpy(base_paths[num_base_layers], token, PATH_MAX - 1);
-                        base_paths[num_base_layers][PATH_MAX - 1] = '\0';
-                        num_base_layers++;
+                    while (token && layers_add(token, 0) == 0)
                         token = strtok(NULL, ",");
-                    }
 
                     free(base_dirs);
                 }
             }
              // if session layer set, but BASE wasnt , default is "/" 
              else {
-                strncpy(base_paths[0], base_path_initial, PATH_MAX - 1);
-                base_paths[0][PATH_MAX - 1] = '\0';
-                num_base_layers = 1;
+                layers_add(base_path_initial, 0);
             }
         } else {
             // when no env vars, auto detect ~/.config/prismafs/default.conf:
@@ -345,7 +485,40 @@ int main(int argc, char *argv[])
         }
     }
 
-    int ret = fuse_main(fuse_argc, fuse_argv, &myfs_oper, NULL);
+    // layer roots stay open for the whole mount, ops work relative to them
+    if (layers_open() != 0) {
+        free(fuse_argv);
+        return 1;
+    }
+
+    lookup_cache_init();
+    kcache_defaults();
+    dircache_init();
+    layer_index_init();
+
+#if FUSE_USE_VERSION < 30
+    // FUSE2 has no fuse_config in init(), cache settings are mount options
+    char cache_opts[256];
+    snprintf(cache_opts, sizeof(cache_opts),
+             "entry_timeout=%g,attr_timeout=%g,negative_timeout=%g%s%s%s",
+             kcache_timeout(RESOLVE_SESSION, kcache.entry_timeout),
+             kcache_timeout(RESOLVE_SESSION, kcache.attr_timeout),
+             kcache.negative_timeout,
+             kcache.kernel_cache ? ",kernel_cache" : "",
+             kcache.auto_cache ? ",auto_cache" : "",
+             kcache.use_ino ? ",use_ino" : "");
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = cache_opts;
+#endif
+    fuse_argv[fuse_argc] = NULL;
+
+    int ret;
+#ifdef __linux__
+    if (use_lowlevel)
+        ret = lowlevel_main(fuse_argc, fuse_argv);
+    else
+#endif
+        ret = fuse_main(fuse_argc, fuse_argv, &myfs_oper, NULL);
     free(fuse_argv);
     return ret;
 }
@@ -0,0 +1,425 @@
+/* ============================================================
+   PrismaFS - manifest.c
+   Precomputed base layer manifest ("prismafs index")
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#include <ftw.h>
+#include <sys/mman.h>
+
+/* -------------------------------------------------------------
+   a manifest is a snapshot of one base layer: every path with the
+   attributes getattr reports and the symlink target. "base <path>
+   index=<file>" maps it and lookups, getattr and readdir of that layer
+   are answered from memory, without touching the layer.
+
+   file layout (host byte order, written and read on the same machine):
+
+     header
+     entries[count]   sorted by (parent dir, name), so all children of a
+                      dir are next to each other: lookup is a binary
+                      search, readdir a slice
+     strings          NUL terminated paths and link targets, starts with
+                      one NUL so offset 0 = empty string
+
+   the manifest is only valid while the layer doesnt change, using one
+   marks the layer readonly.
+   -------------------------------------------------------------
+*/
+
+#define MANIFEST_MAGIC   "PRISMIDX"
+#define MANIFEST_VERSION 1
+
+struct manifest_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t entry_size;   // sizeof(struct manifest_entry), catches layout changes
+    uint64_t count;
+    uint64_t strings_off;  // file offset of the string area
+    uint64_t strings_len;
+};
+
+struct manifest {
+    void *map;
+    size_t map_len;
+    const struct manifest_entry *entries;
+    size_t count;
+    const char *strings;
+};
+
+/* virtual path -> parent dir and name, the sort key.
+   "/" has parent "" so it sorts before everything else */
+static void manifest_split(const char *path, size_t *parent_len, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (strcmp(path, "/") == 0 || !slash) {
+        *parent_len = 0;
+        *name = path;
+        return;
+    }
+    *parent_len = slash == path ? 1 : (size_t)(slash - path);
+    *name = slash + 1;
+}
+
+static int key_cmp(const char *pa, size_t plen_a, const char *na,
+                   const char *pb, size_t plen_b, const char *nb)
+{
+    int c = memcmp(pa, pb, plen_a < plen_b ? plen_a : plen_b);
+    if (c != 0)
+        return c;
+    if (plen_a != plen_b)
+        return plen_a < plen_b ? -1 : 1;
+    return strcmp(na, nb);
+}
+
+const char *manifest_path(const struct manifest *m, const struct manifest_entry *e)
+{
+    return m->strings + e->path_off;
+}
+
+const char *manifest_name(const struct manifest *m, const struct manifest_entry *e)
+{
+    return m->strings + e->path_off + e->name_at;
+}
+
+const char *manifest_target(const struct manifest *m, const struct manifest_entry *e)
+{
+    return m->strings + e->target_off;
+}
+
+static int entry_cmp_key(const struct manifest *m, const struct manifest_entry *e,
+                         const char *parent, size_t parent_len, const char *name)
+{
+    return key_cmp(manifest_path(m, e), e->parent_len, manifest_name(m, e),
+                   parent, parent_len, name);
+}
+
+// first entry not sorting before (parent, name)
+static size_t manifest_lower_bound(const struct manifest *m, const char *parent,
+                                   size_t parent_len, const char *name)
+{
+    size_t lo = 0, hi = m->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entry_cmp_key(m, &m->entries[mid], parent, parent_len, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static const struct manifest_entry *manifest_find_key(const struct manifest *m, const char *parent,
+                                                      size_t parent_len, const char *name)
+{
+    size_t i = manifest_lower_bound(m, parent, parent_len, name);
+    if (i < m->count && entry_cmp_key(m, &m->entries[i], parent, parent_len, name) == 0)
+        return &m->entries[i];
+    return NULL;
+}
+
+// entry for virtual path, NULL when the layer doesnt have it
+const struct manifest_entry *manifest_find(const struct manifest *m, const char *path)
+{
+    size_t parent_len;
+    const char *name;
+
+    manifest_split(path, &parent_len, &name);
+    return manifest_find_key(m, path, parent_len, name);
+}
+
+// same for "name" in virtual dir "dir", no full path needed
+const struct manifest_entry *manifest_find_at(const struct manifest *m, const char *dir,
+                                              const char *name)
+{
+    return manifest_find_key(m, dir, strlen(dir), name);
+}
+
+/* children of virtual dir "dir" as a slice of the sorted entries,
+   *count = 0 when it has none (or isnt in the layer) */
+const struct manifest_entry *manifest_children(const struct manifest *m, const char *dir,
+                                               size_t *count)
+{
+    size_t dir_len = strlen(dir);
+    size_t i = manifest_lower_bound(m, dir, dir_len, "");
+    size_t end = i;
+
+    while (end < m->count && m->entries[end].parent_len == dir_len &&
+           memcmp(manifest_path(m, &m->entries[end]), dir, dir_len) == 0)
+        end++;
+
+    *count = end - i;
+    return m->entries + i;
+}
+
+// dir_scan() over the manifest: children of "dir", no "." and ".."
+int manifest_scan(const struct manifest *m, const char *dir, dir_scan_fn fn, void *arg)
+{
+    size_t count;
+    const struct manifest_entry *e = manifest_children(m, dir, &count);
+
+    for (; count > 0; count--, e++) {
+        int res = fn(manifest_name(m, e), e->ino, IFTODT(e->mode), arg);
+        if (res != 0)
+            return res;
+    }
+    return 0;
+}
+
+void manifest_stat(const struct manifest_entry *e, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode    = e->mode;
+    st->st_size    = e->size;
+    st->st_ino     = e->ino;
+    st->st_nlink   = e->nlink;
+    st->st_uid     = e->uid;
+    st->st_gid     = e->gid;
+    st->st_blksize = 4096;
+    st->st_blocks  = (e->size + 511) / 512;
+    st->st_mtime   = st->st_ctime = st->st_atime = e->mtime_sec;
+#ifdef __APPLE__
+    st->st_mtimespec.tv_nsec = st->st_ctimespec.tv_nsec = st->st_atimespec.tv_nsec = e->mtime_nsec;
+#else
+    st->st_mtim.tv_nsec = st->st_ctim.tv_nsec = st->st_atim.tv_nsec = e->mtime_nsec;
+#endif
+}
+
+/* maps and checks a manifest file. NULL with a message on stderr when
+   it cant be used, the layer is then served from disk as usual */
+struct manifest *manifest_open(const char *file)
+{
+    struct stat st;
+    struct manifest *m = NULL;
+    void *map = MAP_FAILED;
+    const char *why = "not a prismafs manifest";
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        why = strerror(errno);
+        goto fail;
+    }
+    if ((size_t)st.st_size < sizeof(struct manifest_header))
+        goto fail;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        why = strerror(errno);
+        goto fail;
+    }
+
+    const struct manifest_header *h = map;
+    size_t len = st.st_size;
+    if (memcmp(h->magic, MANIFEST_MAGIC, 8) != 0)
+        goto fail;
+    if (h->version != MANIFEST_VERSION || h->entry_size != sizeof(struct manifest_entry)) {
+        why = "written by a different prismafs version, rerun prismafs index";
+        goto fail;
+    }
+    if (h->count > (len - sizeof(*h)) / sizeof(struct manifest_entry) ||
+        h->strings_off < sizeof(*h) + h->count * sizeof(struct manifest_entry) ||
+        h->strings_off > len || h->strings_len == 0 || h->strings_len > len - h->strings_off)
+        goto fail;
+
+    const char *strings = (const char *)map + h->strings_off;
+    const struct manifest_entry *entries = (const void *)((const char *)map + sizeof(*h));
+    if (strings[h->strings_len - 1] != '\0')
+        goto fail;
+
+    // every offset inside the string area, once here instead of on each lookup
+    for (uint64_t i = 0; i < h->count; i++) {
+        const struct manifest_entry *e = &entries[i];
+        if (e->path_off >= h->strings_len || e->target_off >= h->strings_len ||
+            e->name_at > strlen(strings + e->path_off) || e->parent_len > e->name_at)
+            goto fail;
+    }
+
+    if (!(m = malloc(sizeof(*m)))) {
+        why = strerror(ENOMEM);
+        goto fail;
+    }
+    m->map = map;
+    m->map_len = len;
+    m->entries = entries;
+    m->count = h->count;
+    m->strings = strings;
+    close(fd);
+    return m;
+
+fail:
+    fprintf(stderr, "prismafs: ignoring index %s: %s\n", file, why);
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    if (fd != -1)
+        close(fd);
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+   writer, "prismafs index <basedir> [<file>]"
+   -------------------------------------------------------------
+*/
+
+static struct {
+    struct manifest_entry *entries;
+    size_t count, cap;
+    char *strings;
+    size_t strings_len, strings_cap;
+    size_t root_len;       // strlen of basedir without trailing slash
+    int failed;
+} mw;
+
+// appends a NUL terminated string, returns its offset. 0 on out of memory
+static uint64_t mw_string(const char *s, size_t len)
+{
+    if (mw.strings_len + len + 1 > mw.strings_cap) {
+        size_t cap = mw.strings_cap * 2 + len + 1;
+        char *grown = realloc(mw.strings, cap);
+        if (!grown) {
+            mw.failed = 1;
+            return 0;
+        }
+        mw.strings = grown;
+        mw.strings_cap = cap;
+    }
+
+    uint64_t off = mw.strings_len;
+    memcpy(mw.strings + off, s, len);
+    mw.strings[off + len] = '\0';
+    mw.strings_len += len + 1;
+    return off;
+}
+
+static int mw_visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void) ftw;
+    const char *vpath = fpath[mw.root_len] ? fpath + mw.root_len : "/";
+    size_t parent_len;
+    const char *name;
+
+    if (type == FTW_NS || type == FTW_DNR)
+        fprintf(stderr, "prismafs index: cannot read %s, skipped\n", fpath);
+    if (type == FTW_NS)
+        return 0;
+
+    if (mw.count == mw.cap) {
+        size_t cap = mw.cap ? mw.cap * 2 : 1024;
+        struct manifest_entry *grown = realloc(mw.entries, cap * sizeof(*grown));
+        if (!grown) {
+            mw.failed = 1;
+            return 1;
+        }
+        mw.entries = grown;
+        mw.cap = cap;
+    }
+
+    manifest_split(vpath, &parent_len, &name);
+    if (parent_len > UINT16_MAX || name - vpath > UINT16_MAX)
+        return 0; // cant happen below PATH_MAX, keeps the casts honest
+
+    struct manifest_entry *e = &mw.entries[mw.count];
+    memset(e, 0, sizeof(*e));
+    e->path_off   = mw_string(vpath, strlen(vpath));
+    e->parent_len = parent_len;
+    e->name_at    = name - vpath;
+    e->mode       = st->st_mode;
+    e->size       = st->st_size;
+    e->ino        = st->st_ino;
+    e->nlink      = st->st_nlink;
+    e->uid        = st->st_uid;
+    e->gid        = st->st_gid;
+    e->mtime_sec  = st->st_mtime;
+#ifdef __APPLE__
+    e->mtime_nsec = st->st_mtimespec.tv_nsec;
+#else
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(fpath, target, sizeof(target) - 1);
+        if (n > 0)
+            e->target_off = mw_string(target, n);
+    }
+
+    if (mw.failed)
+        return 1;
+    mw.count++;
+    return 0;
+}
+
+// qsort has no context argument on every platform, mw.strings is global
+static int mw_cmp(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = a, *eb = b;
+    const char *pa = mw.strings + ea->path_off, *pb = mw.strings + eb->path_off;
+
+    return key_cmp(pa, ea->parent_len, pa + ea->name_at,
+                   pb, eb->parent_len, pb + eb->name_at);
+}
+
+/* walks basedir and writes the manifest to out (via a temp file renamed
+   into place, a mounted prismafs never sees half of it). 0 or -1 */
+int manifest_write(const char *basedir, const char *out)
+{
+    char tmp[PATH_MAX];
+    int ret = -1;
+
+    memset(&mw, 0, sizeof(mw));
+    mw.root_len = strlen(basedir);
+    while (mw.root_len > 0 && basedir[mw.root_len - 1] == '/')
+        mw.root_len--;
+    mw_string("", 0); // offset 0 = no link target
+
+    if (nftw(basedir, mw_visit, 64, FTW_PHYS) != 0 || mw.failed) {
+        fprintf(stderr, "prismafs index: cannot walk %s: %s\n", basedir,
+                mw.failed ? strerror(ENOMEM) : strerror(errno));
+        goto out;
+    }
+
+    qsort(mw.entries, mw.count, sizeof(*mw.entries), mw_cmp);
+
+    struct manifest_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MANIFEST_MAGIC, 8);
+    h.version     = MANIFEST_VERSION;
+    h.entry_size  = sizeof(struct manifest_entry);
+    h.count       = mw.count;
+    h.strings_off = sizeof(h) + mw.count * sizeof(struct manifest_entry);
+    h.strings_len = mw.strings_len;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "prismafs index: cannot write %s: %s\n", tmp, strerror(errno));
+        goto out;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(mw.entries, sizeof(*mw.entries), mw.count, f);
+    fwrite(mw.strings, 1, mw.strings_len, f);
+    int failed = ferror(f);
+    if (fclose(f) != 0)
+        failed = 1;
+    if (failed || rename(tmp, out) == -1) {
+        fprintf(stderr, "prismafs index: cannot write %s: %s\n", out, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+
+    printf("%zu entries from %s written to %s\n", mw.count, basedir, out);
+    ret = 0;
+
+out:
+    free(mw.entries);
+    free(mw.strings);
+    return ret;
+}
@@ -0,0 +1,157 @@
+/* ============================================================
+   PrismaFS - nameset.c
+   Hash set of filenames, backed by an arena
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+
+/* -------------------------------------------------------------
+   readdir reads entries from session layer and every base layer, the
+   same filename can show up in more than one. nameset tracks what was
+   already listed so it doesnt get listed twice.
+
+   - open addressing with linear probing, so lookups are O(1) and touch
+     one or two cache lines instead of walking a linked list
+   - names are copied into an arena (big chunks, bump allocation),
+     whole set is freed at once in nameset_free()
+   -------------------------------------------------------------
+*/
+
+#define NAMESET_INITIAL_CAP 256          // slots, power of 2
+#define ARENA_CHUNK_SIZE    (64 * 1024)  // bytes per arena chunk
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// bump allocate from current chunk, new chunk when it runs out
+char *arena_strdup(struct name_arena *arena, const char *s, size_t len)
+{
+    struct arena_chunk *c = arena->head;
+
+    if (!c || c->size - c->used < len + 1) {
+        size_t size = len + 1 > ARENA_CHUNK_SIZE ? len + 1 : ARENA_CHUNK_SIZE;
+        c = malloc(sizeof(*c) + size);
+        if (!c)
+            return NULL;
+        c->size = size;
+        c->used = 0;
+        c->next = arena->head;
+        arena->head = c;
+    }
+
+    char *p = c->data + c->used;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    c->used += len + 1;
+    return p;
+}
+
+void arena_free(struct name_arena *arena)
+{
+    struct arena_chunk *c = arena->head;
+
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    arena->head = NULL;
+}
+
+void nameset_init(struct nameset *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+// finds slot holding name, or the empty slot where it would go
+static size_t nameset_slot(const struct nameset *set, const char *name, uint64_t h)
+{
+    size_t mask = set->cap - 1;
+    size_t i = h & mask;
+
+    while (set->names[i]) {
+        if (set->hashes[i] == h && strcmp(set->names[i], name) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// doubles the table, names stay where they are in the arena
+static int nameset_grow(struct nameset *set)
+{
+    size_t new_cap = set->cap ? set->cap * 2 : NAMESET_INITIAL_CAP;
+    const char **names = calloc(new_cap, sizeof(*names));
+    uint64_t *hashes = malloc(new_cap * sizeof(*hashes));
+
+    if (!names || !hashes) {
+        free(names);
+        free(hashes);
+        return -1;
+    }
+
+    for (size_t i = 0; i < set->cap; i++) {
+        if (!set->names[i])
+            continue;
+        size_t j = set->hashes[i] & (new_cap - 1);
+        while (names[j])
+            j = (j + 1) & (new_cap - 1);
+        names[j] = set->names[i];
+        hashes[j] = set->hashes[i];
+    }
+
+    free(set->names);
+    free(set->hashes);
+    set->names = names;
+    set->hashes = hashes;
+    set->cap = new_cap;
+    return 0;
+}
+
+int nameset_contains(const struct nameset *set, const char *name)
+{
+    if (set->count == 0)
+        return 0;
+    return set->names[nameset_slot(set, name, path_hash(name))] != NULL;
+}
+
+// 1 = added, 0 = was already there, -1 = out of memory
+int nameset_add(struct nameset *set, const char *name)
+{
+    // keep load under 70% so probe chains stay short
+    if ((set->count + 1) * 10 > set->cap * 7 && nameset_grow(set) != 0)
+        return -1;
+
+    uint64_t h = path_hash(name);
+    size_t i = nameset_slot(set, name, h);
+    if (set->names[i])
+        return 0;
+
+    const char *copy = arena_strdup(&set->arena, name, strlen(name));
+    if (!copy)
+        return -1;
+
+    set->names[i] = copy;
+    set->hashes[i] = h;
+    set->count++;
+    return 1;
+}
+
+void nameset_free(struct nameset *set)
+{
+    free(set->names);
+    free(set->hashes);
+    arena_free(&set->arena);
+    memset(set, 0, sizeof(*set));
+}
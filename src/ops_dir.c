@@ -12,234 +12,504 @@
    ============================================================ */
 #include "prismafs.h"
 
+/* "foo.deleted" -> 1 and target "foo", anything else -> 0.
+   target must hold NAME_MAX + 1 bytes */
+static int whiteout_target(const char *name, char *target)
+{
+    size_t len = strlen(name);
+
+    if (len <= 8 || strcmp(name + len - 8, ".deleted") != 0)
+        return 0;
+
+    memcpy(target, name, len - 8);
+    target[len - 8] = '\0';
+    return 1;
+}
+
+// "foo.cowmap" in session dir rel is the block map of a sparse copy, never listed
+static int session_sidecar(const char *rel, const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    char child[PATH_MAX];
+
+    // only names with the suffix cost an open
+    if (!dot || strcmp(dot, ".cowmap") != 0 ||
+        snprintf(child, PATH_MAX, "%s/%s", rel, name) >= PATH_MAX)
+        return 0;
+    return cowmap_is_sidecar(session_root_fd, child);
+}
+
+struct merge_state {
+    const char *rel;          // dir being merged, relative to layer roots
+    struct dirlist *dl;
+    struct nameset seen;      // names already in the listing, includes everything in session
+    struct nameset whiteouts; // names masked by .deleted markers in session
+    int layer;                // being scanned
+};
+
+/* session entries. this scan also collects .deleted markers, so base
+   layers below can be filtered in memory without any access() per entry */
+static int merge_session_entry(const char *name, ino_t ino, unsigned char type, void *arg)
+{
+    struct merge_state *ms = arg;
+    char target[NAME_MAX + 1];
+
+    // .deleted markers mask the name in base layers
+    if (whiteout_target(name, target))
+        return nameset_add(&ms->whiteouts, target) == -1 ? ENOMEM : 0;
+
+    // skip hidden files and block maps of sparse copies
+    if (name[0] == '.' || session_sidecar(ms->rel, name))
+        return 0;
+
+    // skip when already listed, otherwise remember it
+    int added = nameset_add(&ms->seen, name);
+    if (added <= 0)
+        return added == 0 ? 0 : ENOMEM;
+
+    return dirlist_append(ms->dl, name, ino, type, RESOLVE_SESSION) != 0 ? ENOMEM : 0;
+}
+
+static int merge_base_entry(const char *name, ino_t ino, unsigned char type, void *arg)
+{
+    struct merge_state *ms = arg;
+
+    // skip hidden files and files marked .deleted in session
+    if (name[0] == '.' || nameset_contains(&ms->whiteouts, name))
+        return 0;
+
+    // skip when already listed (higher layer or session has it)
+    int added = nameset_add(&ms->seen, name);
+    if (added <= 0)
+        return added == 0 ? 0 : ENOMEM;
+
+    return dirlist_append(ms->dl, name, ino, type, ms->layer) != 0 ? ENOMEM : 0;
+}
+
+/* -------------------------------------------------------------
+   with several base layers the scans run on the worker pool while the
+   caller scans session: each base layer is read into its own list, then
+   merged in priority order exactly as if scanned one after another. a
+   cold layer on a slow disk no longer waits for the ones before it.
+   -------------------------------------------------------------
+*/
+struct base_scan {
+    const char *path;
+    const char *rel;
+    struct dirlist **lists;   // [layer], NULL = scan failed
+    int err;                  // -errno of a failed scan, set from any worker
+};
+
+static int collect_entry(const char *name, ino_t ino, unsigned char type, void *arg)
+{
+    if (name[0] == '.')
+        return 0; // hidden and "." "..", never listed from base
+    return dirlist_append(arg, name, ino, type, 0) != 0 ? ENOMEM : 0;
+}
+
+// a partial list would silently drop names, any error leaves the slot NULL
+static void scan_base_task(void *arg, int layer)
+{
+    struct base_scan *bs = arg;
+    struct dirlist *dl = dirlist_new();
+    int res = -ENOMEM;
+
+    if (dl && base_manifests[layer])
+        res = dir_scan_error(manifest_scan(base_manifests[layer], bs->path, collect_entry, dl));
+    else if (dl)
+        res = dir_scan_error(dir_scan(base_root_fds[layer], bs->rel, collect_entry, dl));
+
+    if (res != 0) {
+        dirlist_put(dl);
+        dl = NULL;
+        __atomic_store_n(&bs->err, res, __ATOMIC_RELAXED);
+    }
+    bs->lists[layer] = dl;
+}
+
+/* merges one directory across all layers into a new dirlist:
+   session first, then base layers in priority order. same name in a
+   lower layer is hidden by the higher one, .deleted markers in session
+   hide names in every base layer. a layer that cant be read fails the
+   whole merge, a listing missing its names would look complete.
+   0 or -errno */
+static int dirlist_merge(const char *path, struct dirlist **out)
+{
+    struct merge_state ms;
+    const char *rel = layer_relpath(path);
+    int res = 0;
+
+    ms.rel = rel;
+    ms.dl = dirlist_new();
+    if (!ms.dl)
+        return -ENOMEM;
+
+    nameset_init(&ms.seen);
+    nameset_init(&ms.whiteouts);
+
+    // root dir includes virtual "dev" directory
+    if (strcmp(path, "/") == 0 &&
+        (dirlist_append(ms.dl, "dev", 0, DT_DIR, RESOLVE_ENOENT) != 0 ||
+         nameset_add(&ms.seen, "dev") == -1))
+        res = -ENOMEM;
+
+    // base layers start scanning on the pool while session is read here
+    struct base_scan bs = { path, rel, NULL, 0 };
+    struct work_job job = { scan_base_task, &bs, num_base_layers, 0, 0, NULL };
+    if (merge_threads > 0 && num_base_layers > 1 &&
+        (bs.lists = calloc(num_base_layers, sizeof(*bs.lists))))
+        workpool_submit(&job);
+
+    // session layer first, missing dir there is fine
+    ms.layer = RESOLVE_SESSION;
+    if (res == 0)
+        res = dir_scan_error(dir_scan(session_root_fd, rel, merge_session_entry, &ms));
+
+    if (bs.lists) {
+        workpool_wait(&job);
+        if (res == 0)
+            res = bs.err;
+        for (int i = 0; i < num_base_layers; i++) {
+            struct dirlist *dl = bs.lists[i];
+            ms.layer = i;
+            for (size_t j = 0; res == 0 && j < dl->count; j++)
+                res = -merge_base_entry(dl->entries[j].name, dl->entries[j].ino, dl->entries[j].type, &ms);
+            dirlist_put(dl);
+        }
+        free(bs.lists);
+    } else {
+        // reading files from all base layers, minding .deleted markers and duplicates
+        for (int i = 0; res == 0 && i < num_base_layers; i++) {
+            // same dir in CURRENT base layer, from its manifest when it has one
+            ms.layer = i;
+            if (base_manifests[i])
+                res = dir_scan_error(manifest_scan(base_manifests[i], path, merge_base_entry, &ms));
+            else
+                res = dir_scan_error(dir_scan(base_root_fds[i], rel, merge_base_entry, &ms));
+        }
+    }
+
+    // one bulk free for table and every name in it
+    nameset_free(&ms.seen);
+    nameset_free(&ms.whiteouts);
+
+    if (res != 0) {
+        dirlist_put(ms.dl);
+        return res;
+    }
+    *out = ms.dl;
+    return 0;
+}
+
+/* everything "path" lists except "." and "..", new reference in *out.
+   0 or -errno */
+static int dir_snapshot(const char *path, struct dirlist **out)
+{
+    struct dirlist *dl;
+
+    // "/dev" only contains registered synthetic files
+    if (strcmp(path, "/dev") == 0) {
+        dl = dirlist_new();
+        for (const struct vfile *vf = vfiles; dl && vf->name; vf++) {
+            if (dirlist_append(dl, vf->name, 0, IFTODT(vf->mode), RESOLVE_ENOENT) != 0) {
+                dirlist_put(dl);
+                return -ENOMEM;
+            }
+        }
+        *out = dl;
+        return dl ? 0 : -ENOMEM;
+    }
+
+    // cached merge when layers allow it, otherwise merge now
+    dl = dircache_get(path);
+    if (!dl) {
+        uint64_t gen = dircache_generation();
+
+        int res = dirlist_merge(path, &dl);
+        if (res != 0)
+            return res;
+        dircache_store(path, dl, gen);
+    }
+    *out = dl;
+    return 0;
+}
+
+/* -------------------------------------------------------------
+   directory handles: readdir at offset 0 takes a snapshot of the merged
+   listing and keeps it in the handle, later calls continue from the
+   offset the kernel hands back. a listing is merged once per pass, not
+   once per getdents buffer, and nothing is dropped when a buffer fills.
+   rewinddir comes back as offset 0 and sees a fresh snapshot.
+   -------------------------------------------------------------
+*/
+struct dir_handle {
+    struct dirlist *dl;   // NULL until the first readdir
+};
+
+int myfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    struct dir_handle *dh = calloc(1, sizeof(*dh));
+
+    if (!dh)
+        return -ENOMEM;
+    fi->fh = (uintptr_t)dh;
+    return 0;
+}
+
+int myfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+    struct dir_handle *dh = (struct dir_handle *)(uintptr_t)fi->fh;
+
+    if (dh) {
+        dirlist_put(dh->dl);
+        free(dh);
+    }
+    return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+/* READDIRPLUS: attributes of each entry come from the layer the merge
+   found it in, one fstatat relative to that layer's copy of the dir (or
+   a manifest probe). without them the kernel follows every listing with
+   a getattr per entry, each one a full layer walk */
+struct plus_dirs {
+    const char *path;   // virtual dir being listed
+    int *fds;           // [layer + 1], -2 = not opened yet, -1 = not there
+};
+
+static int plus_stat(struct plus_dirs *pd, const struct dirlist_entry *e, struct stat *st)
+{
+    char child[PATH_MAX];
+
+    if (e->layer == RESOLVE_ENOENT || (e->layer >= 0 && base_manifests[e->layer])) {
+        if (snprintf(child, PATH_MAX, "%s/%s", strcmp(pd->path, "/") == 0 ? "" : pd->path,
+                     e->name) >= PATH_MAX)
+            return -1;
+        if (e->layer == RESOLVE_ENOENT)
+            return myfs_getattr(child, st, NULL); // "/dev" and its files
+
+        const struct manifest_entry *me = manifest_find(base_manifests[e->layer], child);
+        if (!me)
+            return -1;
+        manifest_stat(me, st);
+        return 0;
+    }
+
+    int *fd = &pd->fds[e->layer + 1];
+    if (*fd == -2)
+        *fd = openat(layer_root_fd(e->layer), layer_relpath(pd->path),
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*fd == -1)
+        return -1;
+    return fstatat(*fd, e->name, st, AT_SYMLINK_NOFOLLOW);
+}
+#endif
+
 // readdir operation function implementation
 #if FUSE_USE_VERSION >= 30
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi,
                  enum fuse_readdir_flags flags) {
-    (void) flags;
+    struct plus_dirs pd = { path, NULL };
+
+    if (flags & FUSE_READDIR_PLUS) {
+        if (!(pd.fds = malloc((num_base_layers + 1) * sizeof(int))))
+            return -ENOMEM;
+        for (int i = 0; i <= num_base_layers; i++)
+            pd.fds[i] = -2;
+    }
 #else
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
 #endif
-    (void) offset;
-    (void) fi;
-
-    struct filename_node *filename_list = NULL;
-    DIR *dp;
-    struct dirent *de;
-    char fpath[PATH_MAX];
-    char marker_fpath[PATH_MAX];
-    struct filename_node *current;
-    struct filename_node *next;
-
-    // root dir for default virtual filesystems
-    // filler is FUSE provided callback func filler(buf, name, stat, offset)
-    // returns !0 if buffer is full which shouldnt happen here
-    if (strcmp(path, "/") == 0) {
-        // add standard entries
-        // every directory listing must include "." and ".."
-        FUSE_FILL(buf, ".", NULL, 0);
-        FUSE_FILL(buf, "..", NULL, 0);
-
-        // include "dev" directory
-        if (!is_in_list(filename_list, "dev")) {
-            struct stat st;
-            memset(&st, 0, sizeof(st)); // zero out stat struct
-            st.st_mode = S_IFDIR | 0755; // mark as dir with rwxr-xr-x permissions
-
-            if (FUSE_FILL(buf, "dev", &st, 0))
-                goto cleanup;
-            add_to_list(&filename_list, "dev");
-        }
-    } else if (strcmp(path, "/dev") == 0) {
-        // add std entries
-        FUSE_FILL(buf, ".", NULL, 0);
-        FUSE_FILL(buf, "..", NULL, 0);
-
-        // "cpu" file
-        if (!is_in_list(filename_list, "cpu")) {
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_mode = S_IFREG | 0444; // regular file, read-only permissions
-
-            if (FUSE_FILL(buf, "cpu", &st, 0))
-                goto cleanup;
-            add_to_list(&filename_list, "cpu");
+    OP_STATS(OP_READDIR);
+    struct dir_handle *dh = fi ? (struct dir_handle *)(uintptr_t)fi->fh : NULL;
+    struct dirlist *dl = NULL;
+    int res = 0;
+
+    // no handle (lowlevel backend collecting a listing): one-off snapshot
+    if (dh && dh->dl && offset != 0) {
+        dl = dh->dl;
+    } else {
+        res = dir_snapshot(path, &dl);
+        if (dh) {
+            dirlist_put(dh->dl);
+            dh->dl = dl;
         }
-
-        goto cleanup; // "/dev" only contains "cpu"
+    }
+    if (res != 0) {
+#if FUSE_USE_VERSION >= 30
+        free(pd.fds);
+#endif
+        return res;
     }
 
-    // read files from session layer
-    session_fullpath(fpath, path);
-    dp = opendir(fpath);
-
-    if (dp != NULL) {
-        while ((de = readdir(dp)) != NULL) {
-            // skip hidden files and .deleted markers
-            if (de->d_name[0] == '.' || strstr(de->d_name, ".deleted") != NULL)
-                continue;
-
-            // skip when already in linked list
-            if (is_in_list(filename_list, de->d_name))
-                continue;
+    // "/" and "/dev" list "." and ".." first, they are positions 0 and 1
+    off_t dots = (strcmp(path, "/") == 0 || strcmp(path, "/dev") == 0) ? 2 : 0;
+    off_t total = dots + dl->count;
 
-            // add filename to linked list
-            add_to_list(&filename_list, de->d_name);
+    // filler is FUSE provided callback func filler(buf, name, stat, offset)
+    // offset passed = where the next call resumes, returns !0 if buffer is full
+    for (off_t pos = offset; pos < total; pos++) {
+        const struct dirlist_entry *e = pos < dots ? NULL : &dl->entries[pos - dots];
+        const char *name = e ? e->name : (pos == 0 ? "." : "..");
+        struct stat st;
 
-            // fill directory entry
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = e ? e->ino : 0;
+        st.st_mode = e ? e->type << 12 : S_IFDIR;
 
-            if (FUSE_FILL(buf, de->d_name, &st, 0))
-                break;
-        }
-        closedir(dp);
-    }
-
-    // reading files from all base layers, minding .deleted markers and duplicates
-    for (int i = 0; i < num_base_layers; i++) {
-        // create path for CURRENT base layer
-        snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path);
-        dp = opendir(fpath);
-        if (dp == NULL)
-            continue;
-
-        while ((de = readdir(dp)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
-
-            // skip when already in linked list
-            if (is_in_list(filename_list, de->d_name))
-                continue;
-
-            // .deleted marker path for deleted files (in session)
-            char session_dir[PATH_MAX];
-            session_fullpath(session_dir, path);
-            snprintf(marker_fpath, PATH_MAX, "%s/%s.deleted", session_dir, de->d_name);
-
-            // skip files marked .deleted
-            if (access(marker_fpath, F_OK) == 0)
-                continue;
-
-            // full path to check if file exists in session
-            char session_file_path[PATH_MAX];
-            session_fullpath(session_file_path, path);
-            snprintf(session_file_path, PATH_MAX, "%s/%s", session_file_path, de->d_name);
-
-            // skip files in session layer
-            if (access(session_file_path, F_OK) == 0)
-                continue;
-
-            // add filename to linked list
-            add_to_list(&filename_list, de->d_name);
-
-            struct stat st;
-            memset(&st, 0, sizeof(st));
-            st.st_ino = de->d_ino;
-            st.st_mode = de->d_type << 12;
-
-            if (FUSE_FILL(buf, de->d_name, &st, 0))
-                break;
+#if FUSE_USE_VERSION >= 30
+        enum fuse_fill_dir_flags fill = 0;
+        if (pd.fds && e) {
+            if (plus_stat(&pd, e, &st) == 0) {
+                fill = FUSE_FILL_DIR_PLUS;
+            } else {
+                // gone since the merge, kernel asks with getattr like before
+                memset(&st, 0, sizeof(st));
+                st.st_ino = e->ino;
+                st.st_mode = e->type << 12;
+            }
         }
-        closedir(dp);
+        if (filler(buf, name, &st, pos + 1, fill))
+            break; // buffer full, kernel comes back with pos + 1
+#else
+        if (FUSE_FILL(buf, name, &st, pos + 1))
+            break;
+#endif
     }
 
-// goto
-cleanup:
-    // filename list cleanup
-    current = filename_list;
-    while (current != NULL) {
-        next = current->next;
-        free(current->name);
-        free(current);
-        current = next;
+#if FUSE_USE_VERSION >= 30
+    if (pd.fds) {
+        for (int i = 0; i <= num_base_layers; i++)
+            if (pd.fds[i] >= 0)
+                close(pd.fds[i]);
+        free(pd.fds);
     }
-
+#endif
+    if (!dh)
+        dirlist_put(dl);
     return 0;
 }
 
 // mkdir operation func implementation
 int myfs_mkdir(const char *path, mode_t mode) {
-    char fpath[PATH_MAX];
-
-    // construct full path for directory
-    session_fullpath(fpath, path);
-
-    int res = mkdir(fpath, mode);
+    OP_STATS(OP_MKDIR);
+    // directory goes into session layer, relative to its root fd
+    int res = mkdirat(session_root_fd, layer_relpath(path), mode);
     if (res == -1) {
         return -errno;
     }
+
+    invalidate_path(path);
     return 0;
 }
 
-// rmdir operation func implementation
-int myfs_rmdir(const char *path) {
-    char session_fpath[PATH_MAX];
-    char base_fpath[PATH_MAX];
-
-    session_fullpath(session_fpath, path);
-
-    // directory exists in session layer: remove it
-    if (access(session_fpath, F_OK) == 0) {
-
-   /* before calling rmdir(2), remove .deleted marker files inside this
-      session directory. markers are leftovers from deleted when directory was in use.
-      rmdir(2) requires dir to be empty, so clean them out first or will fail
-      with ENOTEMPTY even if directory looks empty to user */
-
-        DIR *dp = opendir(session_fpath);
-        if (dp) {
-            struct dirent *de;
-            while ((de = readdir(dp)) != NULL) {
-                size_t len = strlen(de->d_name);
-                if (len > 8 && strcmp(de->d_name + len - 8, ".deleted") == 0) {
-                    char marker[PATH_MAX];
-                    snprintf(marker, PATH_MAX, "%s/%s", session_fpath, de->d_name);
-                    unlink(marker);
-                }
-            }
-            closedir(dp);
-        }
-
-        if (rmdir(session_fpath) == -1)
-            return -errno;
+/* -------------------------------------------------------------
+   rmdir(2) needs an empty dir, but a session dir the user sees as empty
+   may still hold bookkeeping: .deleted markers of names deleted while it
+   was in use, block maps whose file is gone and .cowtmp. copies left by
+   a crash. those are removed first, but only once nothing else is left:
+   a map next to a live sparse copy is the only record of which blocks
+   still come from base, losing it on a failed rmdir loses data.
+   a .cowtmp. file may also be a copy-up running right now, those are
+   only touched with every copy-up lock held.
+   -------------------------------------------------------------
+*/
+struct rmdir_scan {
+    const char *rel;   // dir being removed, relative to session root
+    int remove;        // 0 = check only, 1 = unlink leftovers
+    int tmps;          // .cowtmp. files seen
+};
+
+// 1 = bookkeeping rmdir may delete (or "." ".."), 0 = anything else
+static int rmdir_leftover(const char *rel, const char *name)
+{
+    char target[NAME_MAX + 1], child[PATH_MAX];
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        whiteout_target(name, target) ||
+        strncmp(name, COW_TMP_PREFIX, strlen(COW_TMP_PREFIX)) == 0)
+        return 1;
+
+    // block map whose file is gone, nothing reads through it anymore
+    if (!session_sidecar(rel, name) ||
+        snprintf(child, PATH_MAX, "%s/%s", rel, name) >= PATH_MAX)
+        return 0;
+    child[strlen(child) - strlen(".cowmap")] = '\0';
+    return faccessat(session_root_fd, child, F_OK, AT_SYMLINK_NOFOLLOW) == -1;
+}
 
-        // if in base layer, add .deleted marker so deletion is persisting on remounts
-        if (base_fullpath_func(base_fpath, path) == 0) {
-            char deleted_marker[PATH_MAX];
-            snprintf(deleted_marker, PATH_MAX, "%s.deleted", session_fpath);
-            int fd = open(deleted_marker, O_WRONLY | O_CREAT, 0644);
-            if (fd != -1) close(fd);
-        }
+static int rmdir_entry(const char *name, ino_t ino, unsigned char type, void *arg)
+{
+    struct rmdir_scan *rs = arg;
+    char child[PATH_MAX];
+
+    (void) ino; (void) type;
+    if (!rmdir_leftover(rs->rel, name))
+        return ENOTEMPTY;
+    if (strncmp(name, COW_TMP_PREFIX, strlen(COW_TMP_PREFIX)) == 0)
+        rs->tmps++;
+    if (rs->remove && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+        snprintf(child, PATH_MAX, "%s/%s", rs->rel, name) < PATH_MAX)
+        unlinkat(session_root_fd, child, 0);
+    return 0;
+}
 
-        return 0;
+// 0 when session dir rel held nothing but leftovers (now gone), -errno otherwise
+static int rmdir_clean(const char *rel)
+{
+    struct rmdir_scan rs = { rel, 0, 0 };
+    int res = dir_scan(session_root_fd, rel, rmdir_entry, &rs);
+    int locked = 0;
+
+    // temp files: wait out running copy-ups, then look again
+    if (res == 0 && rs.tmps) {
+        copyup_lock_all();
+        locked = 1;
+        res = dir_scan(session_root_fd, rel, rmdir_entry, &rs);
     }
+    if (res == 0) {
+        rs.remove = 1;
+        res = dir_scan(session_root_fd, rel, rmdir_entry, &rs);
+    }
+    res = res == -1 ? -errno : -res;
+    if (locked)
+        copyup_unlock_all();
+    return res;
+}
 
-    // dir only exists in base layer: mask with .deleted marker
-    if (base_fullpath_func(base_fpath, path) == 0) {
-        char *dir_end = strrchr(session_fpath, '/');
-        if (dir_end) {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, session_fpath, dir_end - session_fpath);
-            dir_path[dir_end - session_fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
-
-        char deleted_marker[PATH_MAX];
-        snprintf(deleted_marker, PATH_MAX, "%s.deleted", session_fpath);
+// rmdir operation func implementation
+int myfs_rmdir(const char *path) {
+    OP_STATS(OP_RMDIR);
+    const char *rel = layer_relpath(path);
+    int res;
 
-        int fd = open(deleted_marker, O_WRONLY | O_CREAT, 0644);
-        if (fd == -1)
-            return -errno;
+    // directory exists in session layer: remove it
+    if (faccessat(session_root_fd, rel, F_OK, 0) == 0) {
+        // markers and stale copy-up files would make rmdir(2) fail with
+        // ENOTEMPTY on a dir that looks empty, clear them out first
+        res = rmdir_clean(rel);
+        if (res == 0 && unlinkat(session_root_fd, rel, AT_REMOVEDIR) == -1)
+            res = -errno;
 
-        close(fd);
-        return 0;
+        // if in base layer, add .deleted marker so deletion is persisting on remounts
+        if (res == 0 && base_layer_of(path) != -1)
+            whiteout_create(path);
+    } else if (base_layer_of(path) != -1) {
+        // dir only exists in base layer: mask with .deleted marker
+        session_mkparent(path);
+        res = whiteout_create(path);
+    } else {
+        return -ENOENT;
     }
 
-    return -ENOENT;
+    /* everything below this dir changes resolution, drop every cache.
+       after the change (like unlink and rename), a lookup racing with it
+       would cache the old state otherwise. cleanup may have removed
+       markers even when rmdir itself failed */
+    invalidate_all();
+    return res;
 }
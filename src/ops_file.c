@@ -11,205 +11,520 @@
    ============================================================ */
 #include "prismafs.h"
 
-// open operation func implementation
-int myfs_open(const char *path, struct fuse_file_info *fi)
+// wraps backing fd into a handle for fi->fh
+static struct myfs_handle *handle_new(const char *path, int fd, int in_session, int flags)
 {
-    // opening /dev/cpu
-    if (strcmp(path, "/dev/cpu") == 0) {
-        return 0;
-    }
+    size_t path_len = strlen(path) + 1;
+    struct myfs_handle *h = malloc(sizeof(*h) + path_len);
+
+    if (!h)
+        return NULL;
+
+    h->fd = fd;
+    h->in_session = in_session;
+    h->vc = NULL;
+    h->base_fd = -1;
+    h->map = NULL;
+    h->flags = flags;
+    h->gen = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
+    pthread_rwlock_init(&h->lock, NULL);
+    memcpy(h->path, path, path_len);
+    return h;
+}
 
-    int res;
-    char fpath[PATH_MAX];
+// closes whatever the handle still holds
+static void handle_free(struct myfs_handle *h)
+{
+    if (h->fd != -1)
+        close(h->fd);
+    if (h->base_fd != -1)
+        close(h->base_fd);
+    vcontent_put(h->vc);
+    cowmap_put(h->map);
+    pthread_rwlock_destroy(&h->lock);
+    free(h);
+}
 
-    // try to open file in session layer
-    session_fullpath(fpath, path);
-    res = open(fpath, fi -> flags);
+static struct myfs_handle *handle_of(struct fuse_file_info *fi)
+{
+    return (struct myfs_handle *)(uintptr_t)fi->fh;
+}
 
-    if (res != -1) {
-        close(res);
-        return 0;
+/* swaps the session copy in for the base fd. caller holds h->lock for
+   writing. base fd is not closed yet, a read_buf reply may still be
+   splicing from it. fd is closed and the handle left as it was when
+   the copy's block map cant be used */
+static int handle_use_session(struct myfs_handle *h, int fd)
+{
+    int res = cowmap_open(h->path, fd, &h->map);
+    if (res != 0) {
+        close(fd);
+        return res;
     }
 
-    // check .deleted marker in session
-    char deleted_marker[PATH_MAX];
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
+    h->base_fd = h->fd;
+    h->fd = fd;
+    __atomic_store_n(&h->in_session, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* copy-up for a handle that still points into a base layer.
+   first write (or ftruncate) lands here: CoW the file into session,
+   open the session copy and swap it in for the base fd.
+   caller holds h->lock for writing. */
+static int handle_copy_up(struct myfs_handle *h)
+{
+    const char *rel = layer_relpath(h->path);
+
+    // if file doesnt exist in session layer, copy it from base layer
+    if (faccessat(session_root_fd, rel, F_OK, 0) == -1) {
+        char fpath[PATH_MAX], base_fpath[PATH_MAX];
+
+        // base file went away (mutable base layer), nothing left to copy
+        if (base_fullpath_func(base_fpath, h->path) == -1)
+            return -ENOENT;
+        session_fullpath(fpath, h->path);
+
+        // create dirs
+        session_mkparent(h->path);
+
+        /* copy_up_data() copies whole file (cow_file) or creates a sparse
+            copy with a block map, either way no incomplete dest content on fail.
+            another thread copying the same file at the same time is waited for
+            session copy permissions 0644 = rw-r--r-- */
+        if (copy_up_data(base_fpath, fpath, 0644) < 0)
+            return -EIO;
 
-    if (access(deleted_marker, F_OK) == 0) {
-        // marked/masked as deleted
-        return -ENOENT;
+        // session copy now serves this path
+        invalidate_path(h->path);
     }
 
-    /* file is in base layer — writes will CoW into session via myfs_write/truncate.
-     * do NOT open with fi->flags here: flags may contain O_WRONLY|O_TRUNC which
-     * would truncate the base file directly. Just confirm existence and return. */
-    if (base_fullpath_func(fpath, path) == 0)
+    // session copy stays readable through the same handle unless opened write-only
+    int fd = openat(session_root_fd, rel, (h->flags & O_ACCMODE) == O_WRONLY ? O_WRONLY : O_RDWR);
+    if (fd == -1)
+        return -errno;
+
+    return handle_use_session(h, fd);
+}
+
+/* a handle still reading base while another one copied the file up and
+   wrote to it would keep serving the old data. every copy-up moves
+   entry_gen, when it moved since the last look and a session copy exists
+   now, this handle switches over to it (data stays where it is).
+   0 or -errno when the session copy cant be used */
+static int handle_follow_copy_up(struct myfs_handle *h)
+{
+    uint64_t gen = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
+    int res = 0;
+
+    if (__atomic_load_n(&h->in_session, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&h->gen, __ATOMIC_ACQUIRE) == gen)
         return 0;
-    
 
-    return -ENOENT;
+    pthread_rwlock_wrlock(&h->lock);
+    if (!h->in_session && h->gen != gen) {
+        const char *rel = layer_relpath(h->path);
+
+        __atomic_store_n(&h->gen, gen, __ATOMIC_RELEASE);
+        if (faccessat(session_root_fd, rel, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            int acc = h->flags & O_ACCMODE;
+            int fd = openat(session_root_fd, rel, acc == O_RDONLY ? O_RDONLY :
+                                                  acc == O_WRONLY ? O_WRONLY : O_RDWR);
+            if (fd != -1 && (res = handle_use_session(h, fd)) != 0)
+                __atomic_store_n(&h->gen, gen - 1, __ATOMIC_RELEASE); // try again next read
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return res;
 }
 
-// statfs operation func implementation
-int myfs_statfs(const char *path, struct statvfs *stbuf) {
-    // fill statvfs structure
-    memset(stbuf, 0, sizeof(struct statvfs));
-
-    stbuf->f_bsize   = 4096;
-    stbuf->f_frsize  = 4096;
-    stbuf->f_blocks  = 1024 * 1024;
-    stbuf->f_bfree   = 1024 * 512;
-    stbuf->f_bavail  = 1024 * 512;
-    stbuf->f_files   = 1024 * 1024;
-    stbuf->f_ffree   = 1024 * 512;
-    stbuf->f_namemax = 255;
+/* attributes of an open file from its fd, right even after its name was
+   unlinked or renamed over. 0 or -errno, 1 when the handle has no
+   backing file (/dev content) and the caller should go by path */
+int handle_getattr(struct fuse_file_info *fi, struct stat *st)
+{
+    struct myfs_handle *h = handle_of(fi);
+    if (!h || h->vc)
+        return 1;
 
+    int res = handle_follow_copy_up(h);
+    if (res != 0)
+        return res;
+
+    pthread_rwlock_rdlock(&h->lock);
+    res = fstat(h->fd, st) == -1 ? -errno : 0;
+    pthread_rwlock_unlock(&h->lock);
+    return res;
+}
+
+// takes h->lock for reading with fd guaranteed in session layer
+static int handle_lock_session(struct myfs_handle *h)
+{
+    pthread_rwlock_rdlock(&h->lock);
+    if (h->in_session)
+        return 0;
+    pthread_rwlock_unlock(&h->lock);
+
+    pthread_rwlock_wrlock(&h->lock);
+    int res = h->in_session ? 0 : handle_copy_up(h);
+    pthread_rwlock_unlock(&h->lock);
+    if (res != 0)
+        return res;
+
+    // once in session a handle never goes back to base
+    pthread_rwlock_rdlock(&h->lock);
     return 0;
 }
 
-// read operation func implementation
-int myfs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi) {
+// open operation func implementation
+// resolves the layer once, backing fd is kept in fi->fh until release
+int myfs_open(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_OPEN);
+    // /dev file: content generated now, reads see this snapshot until release
+    const struct vfile *vf = vfile_lookup(path);
+    if (vf) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+
+        struct myfs_handle *h = handle_new(path, -1, 1, fi->flags);
+        if (!h)
+            return -ENOMEM;
+        if (!(h->vc = vfile_content(vf))) {
+            free(h);
+            return -ENOMEM;
+        }
+
+        // uncached files report size 0, kernel must ask us instead of trusting st_size
+        fi->direct_io = vf->ttl == 0;
+        fi->fh = (uintptr_t)h;
+        return 0;
+    }
 
-    // for reading from /dev/cpu
-    if (strcmp(path, "/dev/cpu") == 0) {
-        // generate CPU stats
-        char cpu_info[1024];
-        int len;
+    int fd;
 
-        // get CPU brand string
-        char cpu_brand[256];
-        #ifdef __APPLE__
-        size_t len_cpu_brand = sizeof(cpu_brand);
+    // before resolving, a copy-up finishing after it moves this again
+    uint64_t gen = __atomic_load_n(&entry_gen, __ATOMIC_ACQUIRE);
 
-        if (sysctlbyname("machdep.cpu.brand_string", cpu_brand, &len_cpu_brand, NULL, 0) == -1) {
-            perror("sysctlbyname");
-            return -EIO;
+    // whiteout, session, then base layers (cached), opened relative to layer root
+    int layer = resolve_path(path, NULL);
+
+    if (layer == RESOLVE_SESSION) {
+        fd = openat(session_root_fd, layer_relpath(path), fi->flags);
+        if (fd == -1)
+            return -errno;
+
+        struct myfs_handle *h = handle_new(path, fd, 1, fi->flags);
+        if (!h) {
+            close(fd);
+            return -ENOMEM;
         }
 
-        #else
+        // partial (sparse) copy, untouched blocks still come from base
+        int res = cowmap_open(path, fd, &h->map);
+        if (res != 0) {
+            handle_free(h);
+            return res;
+        }
+        if (h->map && (fi->flags & O_TRUNC))
+            cowmap_truncate(h->map, fd, 0);
 
-        struct utsname uts;
-        if (uname(&uts) == -1) {
-            perror("uname");
-            return -EIO;
+        fi->fh = (uintptr_t)h;
+        return 0;
+    }
+
+    /* file is in base layer — writes will CoW into session via myfs_write/truncate.
+     * do NOT open with fi->flags here: flags may contain O_WRONLY|O_TRUNC which
+     * would truncate the base file directly. base fd is always read-only. */
+    if (layer >= 0) {
+        fd = openat(base_root_fds[layer], layer_relpath(path), O_RDONLY);
+        if (fd == -1)
+            return -errno;
+
+        struct myfs_handle *h = handle_new(path, fd, 0, fi->flags);
+        if (!h) {
+            close(fd);
+            return -ENOMEM;
         }
+        h->gen = gen;
+        fi->fh = (uintptr_t)h;
 
-        snprintf(cpu_brand, sizeof(cpu_brand), "%s", uts.machine);
+        // readonly base file cant change, page cache from earlier opens is still good
+        if (base_flags[layer] & LAYER_READONLY)
+            fi->keep_cache = 1;
+        return 0;
+    }
 
-        #endif
+    // masked by .deleted marker or not in any layer
+    return -ENOENT;
+}
 
-        len = snprintf(cpu_info, sizeof(cpu_info), "CPU Brand: %s\n", cpu_brand);
+/* -------------------------------------------------------------
+   statfs reports the session layer, thats where every write and
+   copy-up lands, so its free space is what callers can actually use.
+   total is configurable (statfs_total): session fs size, session plus
+   whats used on base layer filesystems, or a fixed number of bytes.
+   df polling agents call this a lot, result is kept statfs_ttl seconds.
+   -------------------------------------------------------------
+*/
+int      statfs_total = STATFS_TOTAL_SESSION;
+uint64_t statfs_total_bytes = 0;
+double   statfs_ttl = 1.0;
+
+static struct statvfs statfs_cached;
+static double statfs_expires = 0;
+static pthread_mutex_t statfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// bytes used on base layer filesystems, each fs counted once, session fs not at all
+static uint64_t base_used_bytes(void)
+{
+    dev_t *seen = malloc((num_base_layers + 1) * sizeof(*seen));
+    int nseen = 0;
+    uint64_t used = 0;
+    struct stat st;
 
-        // for offset
-        if (offset < len) {
-            if (offset + size > (size_t)len)
-                size = len - offset;
-            memcpy(buf, cpu_info + offset, size);
-        } else {
-            size = 0;
-        }
+    if (!seen)
+        return 0;
+    if (fstat(session_root_fd, &st) == 0)
+        seen[nseen++] = st.st_dev;
 
-        return size;
+    for (int i = 0; i < num_base_layers; i++) {
+        struct statvfs sv;
+        int dup = 0;
+
+        if (fstat(base_root_fds[i], &st) == -1 || fstatvfs(base_root_fds[i], &sv) == -1)
+            continue;
+        for (int j = 0; j < nseen; j++)
+            dup |= seen[j] == st.st_dev;
+        if (dup)
+            continue;
+
+        seen[nseen++] = st.st_dev;
+        used += (uint64_t)(sv.f_blocks - sv.f_bfree) * sv.f_frsize;
     }
+    free(seen);
+    return used;
+}
 
-    int fd;
-    int res;
-    char fpath[PATH_MAX];
+static int statfs_uncached(struct statvfs *stbuf)
+{
+    if (fstatvfs(session_root_fd, stbuf) == -1)
+        return -errno;
 
-    // try to open file in session layer
-    session_fullpath(fpath, path);
+    uint64_t frsize = stbuf->f_frsize ? stbuf->f_frsize : stbuf->f_bsize;
+    if (statfs_total == STATFS_TOTAL_SUM)
+        stbuf->f_blocks += base_used_bytes() / frsize;
+    else if (statfs_total == STATFS_TOTAL_FIXED)
+        stbuf->f_blocks = statfs_total_bytes / frsize;
 
-    fd = open(fpath, O_RDONLY);
+    // fixed total smaller than whats free would make df report negative usage
+    if (stbuf->f_blocks < stbuf->f_bfree)
+        stbuf->f_blocks = stbuf->f_bfree;
+    return 0;
+}
 
-    if (fd != -1) {
-        // read from file
-        res = pread(fd, buf, size, offset);
-        if (res == -1)
-            res = -errno;
-        close(fd);
-        return res;
+// statfs operation func implementation
+int myfs_statfs(const char *path, struct statvfs *stbuf) {
+    OP_STATS(OP_STATFS);
+    (void) path;
+
+    if (statfs_ttl <= 0)
+        return statfs_uncached(stbuf);
+
+    double now = monotonic_now();
+    int res = 0;
+
+    pthread_mutex_lock(&statfs_lock);
+    if (now >= statfs_expires) {
+        res = statfs_uncached(&statfs_cached);
+        statfs_expires = res == 0 ? now + statfs_ttl : 0;
     }
+    if (res == 0)
+        *stbuf = statfs_cached;
+    pthread_mutex_unlock(&statfs_lock);
+
+    return res;
+}
+
+// reads from a /dev file snapshot
+static int vcontent_read(struct vcontent *vc, char *buf, size_t size, off_t offset)
+{
+    if ((size_t)offset >= vc->len)
+        return 0;
+    if (offset + size > vc->len)
+        size = vc->len - offset;
+    memcpy(buf, vc->data + offset, size);
+    return size;
+}
 
-    // check .deleted marker in the session layer
-    char deleted_marker[PATH_MAX];
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
+// read operation func implementation
+int myfs_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+    OP_STATS(OP_READ);
+    (void) path;
+
+    struct myfs_handle *h = handle_of(fi);
+    if (!h)
+        return -EBADF;
+    if (h->vc)
+        return vcontent_read(h->vc, buf, size, offset);
+
+    // read straight from the fd resolved at open time (or its session copy since)
+    int res = handle_follow_copy_up(h);
+    if (res != 0)
+        return res;
+    pthread_rwlock_rdlock(&h->lock);
+    if (h->map)
+        res = cowmap_read(h->map, h->fd, buf, size, offset);
+    else if ((res = pread(h->fd, buf, size, offset)) == -1)
+        res = -errno;
+    pthread_rwlock_unlock(&h->lock);
 
-    if (access(deleted_marker, F_OK) == 0) {
-        // masked as deleted
-        return -ENOENT;
+    return res;
+}
+
+/* read_buf operation func implementation
+   instead of pread into a buffer, hand libfuse the backing fd and offset.
+   with splice support it moves pages from the layer file straight into
+   /dev/fuse, data never gets copied through our memory.
+   libfuse does the actual reading after we return, so every fd put in
+   the bufvec has to stay open until release (see handle_copy_up). */
+int myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_READ);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h)
+        return -EBADF;
+
+    // /dev files have no backing fd, plain read into memory buffer
+    if (h->vc) {
+        struct fuse_bufvec *bv = malloc(sizeof(*bv));
+        char *mem = malloc(size ? size : 1);
+        int res = (bv && mem) ? vcontent_read(h->vc, mem, size, offset) : -ENOMEM;
+
+        if (res < 0) {
+            free(bv);
+            free(mem);
+            return res;
+        }
+        *bv = FUSE_BUFVEC_INIT(res);
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
     }
 
-    // if not in session layer and not masked, try base layers
-    for (int i = 0; i < num_base_layers; i++) {
-        // full path for current base layer
-        if (base_paths[i][strlen(base_paths[i]) - 1] == '/' && path[0] == '/')
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path + 1);
-        else
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path);
-
-        // check file is in current base layer
-        if (access(fpath, F_OK) == 0) {
-            fd = open(fpath, O_RDONLY);
-            if (fd != -1) {
-                // read from file
-                res = pread(fd, buf, size, offset);
-                if (res == -1)
-                    res = -errno;
-                close(fd);
-                return res;
+    int res = handle_follow_copy_up(h);
+    if (res != 0)
+        return res;
+
+    struct fuse_bufvec *bv = malloc(sizeof(*bv));
+    if (!bv)
+        return -ENOMEM;
+    *bv = FUSE_BUFVEC_INIT(size);
+    bv->count = 0;
+
+    // sparse copy: one segment per run of blocks served by the same file
+    size_t cap = 1, done = 0;
+    pthread_rwlock_rdlock(&h->lock);
+    do {
+        if (bv->count == cap) {
+            struct fuse_bufvec *grown = realloc(bv, sizeof(*bv) + (cap * 2 - 1) * sizeof(struct fuse_buf));
+            if (!grown) {
+                pthread_rwlock_unlock(&h->lock);
+                free(bv);
+                return -ENOMEM;
             }
+            bv = grown;
+            cap *= 2;
         }
-    }
 
-    // file not in any layer
-    return -ENOENT;
+        struct fuse_buf *b = &bv->buf[bv->count++];
+        int fd = h->fd;
+        size_t chunk = size - done;
+
+        if (h->map)
+            chunk = cowmap_extent(h->map, h->fd, offset + done, chunk, &fd);
+
+        memset(b, 0, sizeof(*b));
+        b->size  = chunk;
+        b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        b->fd    = fd;
+        b->pos   = offset + done;
+        done += chunk;
+    } while (done < size);
+    pthread_rwlock_unlock(&h->lock);
+
+    *bufp = bv;
+    return 0;
+}
+
+/* takes h->lock for reading with fd in session and, for a sparse copy,
+   the blocks [offset, offset + size) already brought over from base.
+   first write through a base-layer handle copies the file up. */
+static int handle_lock_write(struct myfs_handle *h, off_t offset, size_t size)
+{
+    int res = handle_lock_session(h);
+    if (res != 0)
+        return res;
+
+    // sparse copy: bring blocks being written over from base first
+    if (h->map && (res = cowmap_fill(h->map, h->fd, offset, size)) != 0) {
+        pthread_rwlock_unlock(&h->lock);
+        return res;
+    }
+    return 0;
 }
 
 // write operation func implementation
 int myfs_write(const char *path, const char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
-    char fpath[PATH_MAX];
-
-    // write operations need to happen in session layer
-    session_fullpath(fpath, path);
+    OP_STATS(OP_WRITE);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h)
+        return -EBADF;
+
+    int res = handle_lock_write(h, offset, size);
+    if (res != 0)
+        return res;
 
-    // if file doesnt exist in session layer, copy it from base layer
-    if (access(fpath, F_OK) == -1)
-    {
-        char base_fpath[PATH_MAX];
-        base_fullpath_func(base_fpath, path);
+    res = pwrite(h->fd, buf, size, offset);
+    if (res == -1)
+        res = -errno;
 
-        // create dirs
-        char *dir_end = strrchr(fpath, '/');
-        if (dir_end)
-        {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, fpath, dir_end - fpath);
-            dir_path[dir_end - fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
+    pthread_rwlock_unlock(&h->lock);
+    return res;
+}
 
-        // copy file from base layer into session (CoW)
-        /* now cow_file() does copying checking writes and removes any incomplete dest content on fail 
-            session copy permissions 0644 = rw-r--r-- */
-        if (cow_file(base_fpath, fpath, 0644) != 0)
-            return -EIO;
-    }
+/* write_buf operation func implementation
+   incoming data may still sit in the /dev/fuse pipe, fuse_buf_copy
+   splices it into the session fd without copying it through our memory.
+   libfuse uses this instead of write when both are set. */
+int myfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    OP_STATS(OP_WRITE);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h)
+        return -EBADF;
+
+    size_t size = fuse_buf_size(buf);
+    int res = handle_lock_write(h, offset, size);
+    if (res != 0)
+        return res;
 
-    // open file in session layer for writing
-    fd = open(fpath, O_WRONLY);
-    if (fd == -1)
-        return -errno;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd    = h->fd;
+    dst.buf[0].pos   = offset;
 
-    res = pwrite(fd, buf, size, offset);
-    if (res == -1)
-        res = -errno;
+    res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
 
-    close(fd);
+    pthread_rwlock_unlock(&h->lock);
     return res;
 }
 
@@ -217,70 +532,162 @@ int myfs_write(const char *path, const char *buf, size_t size,
 #if FUSE_USE_VERSION >= 30
 int myfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-    (void) fi;
+    OP_STATS(OP_TRUNCATE);
+
+    // ftruncate on an open file, reuse its handle (and its copy-up)
+    if (fi && fi->fh) {
+        struct myfs_handle *h = handle_of(fi);
+        int res = handle_lock_session(h);
+        if (res != 0)
+            return res;
+
+        if (h->map)
+            res = cowmap_truncate(h->map, h->fd, size);
+        if (res == 0 && ftruncate(h->fd, size) == -1)
+            res = -errno;
+
+        pthread_rwlock_unlock(&h->lock);
+        return res;
+    }
 #else
 int myfs_truncate(const char *path, off_t size)
 {
+    OP_STATS(OP_TRUNCATE);
 #endif
-    char fpath[PATH_MAX];
-
     // truncate happens in session layer
-    session_fullpath(fpath, path);
+    const char *rel = layer_relpath(path);
 
     // copy file from base layer if not in session yet
-    if (access(fpath, F_OK) == -1)
+    if (faccessat(session_root_fd, rel, F_OK, 0) == -1)
     {
-        char base_fpath[PATH_MAX];
-        base_fullpath_func(base_fpath, path);
+        char fpath[PATH_MAX], base_fpath[PATH_MAX];
+
+        // in no layer at all, nothing to copy up or truncate
+        if (base_fullpath_func(base_fpath, path) == -1)
+            return -ENOENT;
+        session_fullpath(fpath, path);
 
         // create dirs
-        char *dir_end = strrchr(fpath, '/');
-        if (dir_end)
-        {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, fpath, dir_end - fpath);
-            dir_path[dir_end - fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
+        session_mkparent(path);
 
-         // copy file from base layer into session (CoW)
-        /* now cow_file() does copying checking writes and removes any incomplete dest content on fail 
+         // copy file from base layer into session (CoW), whole or sparse
+        /* copy_up_data() removes any incomplete dest content on fail 
             session copy permissions 0644 = rw-r--r-- */
-        if (cow_file(base_fpath, fpath, 0644) != 0)
+        if (copy_up_data(base_fpath, fpath, 0644) < 0)
             return -EIO;
+
+        invalidate_path(path);
     }
 
-    // truncate file
-    int res = truncate(fpath, size);
-    if (res == -1)
+    // partial copy: block map has to learn about the new end first
+    int fd = openat(session_root_fd, rel, O_WRONLY);
+    if (fd == -1)
         return -errno;
 
-    return 0;
+    struct cowmap *map;
+    int res = cowmap_open(path, fd, &map);
+    if (map) {
+        res = cowmap_truncate(map, fd, size);
+        cowmap_put(map);
+    }
+
+    // truncate file
+    if (res == 0 && ftruncate(fd, size) == -1)
+        res = -errno;
+
+    close(fd);
+    return res;
 }
 
 // create operation func implementation
 int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    OP_STATS(OP_CREATE);
     int res;
-    char fpath[PATH_MAX];
-
-    // create file in session layer
-    session_fullpath(fpath, path);
 
     // create directories
-    char *dir_end = strrchr(fpath, '/');
-    if (dir_end)
-    {
-        char dir_path[PATH_MAX];
-        strncpy(dir_path, fpath, dir_end - fpath);
-        dir_path[dir_end - fpath] = '\0';
-        mkdir(dir_path, 0755);
-    }
+    session_mkparent(path);
 
-    res = open(fpath, fi->flags, mode);
+    // create file in session layer
+    res = openat(session_root_fd, layer_relpath(path), fi->flags, mode);
     if (res == -1)
         return -errno;
 
-    fi->fh = res;
+    invalidate_path(path);
+
+    struct myfs_handle *h = handle_new(path, res, 1, fi->flags);
+    if (!h) {
+        close(res);
+        return -ENOMEM;
+    }
+
+    /* existing partial copy opened through create keeps its map, a map
+       next to a fresh or truncated (empty) file is stale: drop it */
+    struct stat st;
+    int err = cowmap_open(path, res, &h->map);
+    if (err != 0) {
+        handle_free(h);
+        return err;
+    }
+    if (h->map && fstat(res, &st) == 0 && st.st_size == 0)
+        cowmap_truncate(h->map, res, 0);
+
+    fi->fh = (uintptr_t)h;
     return 0;
 }
+
+// flush operation func implementation
+// called on every close() of a file descriptor. closing a dup of the
+// backing fd gives the underlying fs the same close semantics (locks, NFS)
+int myfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_FLUSH);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h || h->vc)
+        return 0;
+
+    pthread_rwlock_rdlock(&h->lock);
+    int fd = dup(h->fd);
+    int res = fd == -1 ? -errno : close(fd) == -1 ? -errno : 0;
+    pthread_rwlock_unlock(&h->lock);
+
+    return res;
+}
+
+// release operation func implementation
+// last reference to the open file is gone, drop the backing fd
+int myfs_release(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_RELEASE);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h)
+        return 0;
+
+    handle_free(h);
+    fi->fh = 0;
+    return 0;
+}
+
+// fsync operation func implementation
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_FSYNC);
+    (void) path;
+    struct myfs_handle *h = handle_of(fi);
+    if (!h || h->vc)
+        return 0;
+
+    int res;
+    pthread_rwlock_rdlock(&h->lock);
+#ifdef __APPLE__
+    (void) datasync;
+    res = fsync(h->fd);
+#else
+    res = datasync ? fdatasync(h->fd) : fsync(h->fd);
+#endif
+    pthread_rwlock_unlock(&h->lock);
+
+    return res == -1 ? -errno : 0;
+}
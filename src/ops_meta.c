@@ -10,124 +10,163 @@
  *     http://www.apache.org/licenses/LICENSE-2.0
    ============================================================ */
 #include "prismafs.h"
+#ifdef __linux__
+#include <sys/syscall.h>   // SYS_renameat2, glibc only wraps it since 2.28
+#endif
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE  (1 << 1)
+#endif
+
+/* -------------------------------------------------------------
+   kernel side caching. every getattr/lookup the kernel can answer from
+   its own dentry/attr cache is a request that never reaches us.
+   everything in session changes only through the mount (kernel sees
+   it), so only base layers that change behind our back limit how long
+   the kernel may trust what we told it. readonly base layers cant.
+   -------------------------------------------------------------
+*/
+struct kernel_cache_opts kcache = {
+    .entry_timeout    = 1.0,
+    .attr_timeout     = 1.0,
+    .negative_timeout = -1.0,   // not configured, see kcache_defaults()
+    .readonly_timeout = 0.0,
+};
+
+/* timeouts for an entry served from layer (RESOLVE_SESSION or base index).
+   readonly_timeout applies to readonly base layers, and to everything
+   when all base layers are readonly (nothing can change behind our back) */
+double kcache_timeout(int layer, double dflt)
+{
+    if (kcache.readonly_timeout <= 0)
+        return dflt;
+    if (layer >= 0 ? (base_flags[layer] & LAYER_READONLY) : all_base_readonly())
+        return kcache.readonly_timeout > dflt ? kcache.readonly_timeout : dflt;
+    return dflt;
+}
+
+/* after config and layers_open(). kernel may remember misses as long as
+   we do when only the mount can create names: session changes go through
+   the kernel, which drops its own negative entry on create */
+void kcache_defaults(void)
+{
+    if (kcache.negative_timeout < 0)
+        kcache.negative_timeout = all_base_readonly() ? negative_ttl : 0;
+}
+
+// init operation, mount time setup of the kernel caches and splice
+#if FUSE_USE_VERSION >= 30
+/* replies to read_buf are fd segments, splicing them into /dev/fuse
+   needs SPLICE_WRITE. libfuse leaves it off unless asked for.
+   SPLICE_READ lets write requests arrive in a pipe for write_buf.
+   READDIRPLUS: listings carry attributes, no getattr per entry after */
+void conn_want(struct fuse_conn_info *conn)
+{
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE |
+                                   FUSE_CAP_SPLICE_READ | FUSE_CAP_READDIRPLUS |
+                                   FUSE_CAP_READDIRPLUS_AUTO);
+}
+
+void *myfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    conn_want(conn);
+
+    // high-level timeouts are per mount, long ones only when nothing can go stale
+    cfg->entry_timeout    = kcache_timeout(RESOLVE_SESSION, kcache.entry_timeout);
+    cfg->attr_timeout     = kcache_timeout(RESOLVE_SESSION, kcache.attr_timeout);
+    cfg->negative_timeout = kcache.negative_timeout;
+    cfg->kernel_cache     = kcache.kernel_cache;
+    cfg->auto_cache       = kcache.auto_cache;
+    cfg->use_ino          = kcache.use_ino;
+    return NULL;
+}
+#else
+// FUSE2 takes these as -o options, see main()
+void *myfs_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+    return NULL;
+}
+#endif
 
 // getattr operation function implementation
 #if FUSE_USE_VERSION >= 30
 int myfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-    (void) fi;
 #else
 int myfs_getattr(const char *path, struct stat *stbuf) {
 #endif
+    OP_STATS(OP_GETATTR);
 
     memset(stbuf, 0, sizeof(struct stat));
 
-    // handle special /dev directory and /dev/cpu file
+#if FUSE_USE_VERSION >= 30
+    // fstat() of an open file goes to its fd, the name may be gone by now
+    if (fi && fi->fh) {
+        int res = handle_getattr(fi, stbuf);
+        if (res <= 0)
+            return res;
+    }
+#endif
+
+    // handle special /dev directory and the files registered under it
     if (strcmp(path, "/") == 0 || strcmp(path, "/dev") == 0) {
         stbuf->st_mode  = S_IFDIR | 0755; // directory permissions
         stbuf->st_nlink = 2;
         return 0;
-    } else if (strcmp(path, "/dev/cpu") == 0) {
-
-        char cpu_brand[256];
-        #ifdef __APPLE__
-        size_t len_cpu_brand = sizeof(cpu_brand);
-
-        if (sysctlbyname("machdep.cpu.brand_string", cpu_brand, &len_cpu_brand, NULL, 0) == -1)
-            strncpy(cpu_brand, "Unknown CPU", sizeof(cpu_brand) - 1);
-
-        #else
-
-        struct utsname uts;
-        if (uname(&uts) == 0)
-            snprintf(cpu_brand, sizeof(cpu_brand), "%s", uts.machine);
-        else
-            strncpy(cpu_brand, "Unknown CPU", sizeof(cpu_brand) - 1);
-
-        #endif
-
-        size_t content_length = strlen("CPU Brand: ") + strlen(cpu_brand) + 1;
+    }
 
-        stbuf->st_mode  = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        stbuf->st_size  = content_length;
+    const struct vfile *vf = vfile_lookup(path);
+    if (vf) {
+        vfile_getattr(vf, stbuf);
         return 0;
     }
 
-    char fpath[PATH_MAX];
-    int res;
-
-    // check session layer
-    session_fullpath(fpath, path);
-
-    char deleted_marker[PATH_MAX];
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
-
-    // is there .deleted marker in session layer?
-    if (access(deleted_marker, F_OK) == 0) {
-        // file marked (masked) as deleted
+    // find the layer serving this path (whiteout, session, base), cached
+    int layer = resolve_path(path, NULL);
+    if (layer < RESOLVE_SESSION)
         return -ENOENT;
-    }
-
-    res = lstat(fpath, stbuf);
-    if (res == 0)
-        return 0;
 
-    // checking every base layer
-    for (int i = 0; i < num_base_layers; i++) {
-        // creating path in base layer
-        if (base_paths[i][strlen(base_paths[i]) - 1] == '/' && path[0] == '/')
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path + 1);
-        else
-            snprintf(fpath, PATH_MAX, "%s%s", base_paths[i], path);
-
-        // check for .deleted marker
-        if (access(deleted_marker, F_OK) == 0) {
-            // marked deleted
-            return -ENOENT;
+    // indexed base layer, attributes are in the manifest
+    if (layer >= 0 && base_manifests[layer]) {
+        const struct manifest_entry *e = manifest_find(base_manifests[layer], path);
+        if (e) {
+            manifest_stat(e, stbuf);
+            return 0;
         }
-
-        res = lstat(fpath, stbuf);
-        if (res == 0) return 0;
     }
 
-    return -ENOENT;
+    // relative to the layer root fd, no absolute path to walk
+    if (fstatat(layer_root_fd(layer), layer_relpath(path), stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+
+    // changed behind our back, forget cached resolution
+    lookup_invalidate(path);
+    return -errno;
 }
 
 // access operation func implementation
 int myfs_access(const char *path, int mask) {
+    OP_STATS(OP_ACCESS);
     // root accessible and writable (writes to session layer)
     if (strcmp(path, "/") == 0)
         return 0;
 
-    // /dev = synthetic read-only dir, /dev/cpu = synthetic read-only file
-    if (strcmp(path, "/dev") == 0 || strcmp(path, "/dev/cpu") == 0)
+    // /dev = synthetic read-only dir, files in it are read-only too
+    if (strcmp(path, "/dev") == 0 || vfile_lookup(path))
         return (mask & W_OK) ? -EACCES : 0;
 
-    char fpath[PATH_MAX];
-    char deleted_marker[PATH_MAX];
-
-    // checking .deleted marker in session layer
-    session_fullpath(fpath, path);
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
-
-    if (access(deleted_marker, F_OK) == 0)
+    // whichever layer serves this path (session first)
+    // ask OS if file is there and accessible with requested permission
+    int layer = resolve_path(path, NULL);
+    if (layer < RESOLVE_SESSION)
         return -ENOENT;
 
-    // fpath is pointing at session layer location for this path
-    // ask OS if file is there and accessible with requested permission
-    if (access(fpath, mask) == 0)
+    if (faccessat(layer_root_fd(layer), layer_relpath(path), mask, 0) == 0)
         return 0;
-    if (errno != ENOENT)
-        return -errno;
-
-    // search base layers for the file and overwrite fpath with path to where it was found
-    if (base_fullpath_func(fpath, path) == 0) {
-        if (access(fpath, mask) == 0)
-            return 0;
-        return -errno;
-    }
-
-    return -ENOENT;
+    return -errno;
 }
 
 // chmod operation func implementation
@@ -139,38 +178,39 @@ int myfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 int myfs_chmod(const char *path, mode_t mode)
 {
 #endif
-    char fpath[PATH_MAX];
-    char base_fpath[PATH_MAX];
-
-    session_fullpath(fpath, path);
+    OP_STATS(OP_CHMOD);
+    const char *rel = layer_relpath(path);
 
    /* chmod needs to modify file, but base layer must not be touched directly.
       if file is only in base layer, copy it into session layer,
       then apply permission change to session copy */
-    if (access(fpath, F_OK) == -1) {
-        if (base_fullpath_func(base_fpath, path) == -1)
+    if (faccessat(session_root_fd, rel, F_OK, 0) == -1) {
+        int layer = base_layer_of(path);
+        if (layer == -1)
             return -ENOENT;
 
         // parent directory exists in session layer?
-        char *dir_end = strrchr(fpath, '/');
-        if (dir_end) {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, fpath, dir_end - fpath);
-            dir_path[dir_end - fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
+        session_mkparent(path);
 
         struct stat st;
-        if (lstat(base_fpath, &st) == 0 && S_ISDIR(st.st_mode)) {
-            if (mkdir(fpath, st.st_mode & 0777) == -1 && errno != EEXIST)
+        if (fstatat(base_root_fds[layer], rel, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISDIR(st.st_mode)) {
+            if (mkdirat(session_root_fd, rel, st.st_mode & 0777) == -1 && errno != EEXIST)
                 return -errno;
         } else {
-            int cow_ret = cow_file(base_fpath, fpath, 0644);
-            if (cow_ret != 0) return cow_ret;
+            // only the mode changes, metacopy leaves the data in base
+            char fpath[PATH_MAX], base_fpath[PATH_MAX];
+            session_fullpath(fpath, path);
+            base_layer_fullpath(base_fpath, layer, path);
+            int cow_ret = copy_up_meta(base_fpath, fpath, 0644);
+            if (cow_ret < 0) return cow_ret;
         }
     }
 
-    if (chmod(fpath, mode) == -1)
+    // session copy now serves this path
+    invalidate_path(path);
+
+    if (fchmodat(session_root_fd, rel, mode, 0) == -1)
         return -errno;
     return 0;
 }
@@ -178,45 +218,43 @@ int myfs_chmod(const char *path, mode_t mode)
 // unlink operation func implementation
 int myfs_unlink(const char *path)
 {
-    char session_fpath[PATH_MAX];
-    char base_fpath[PATH_MAX];
-
-    // full paths
-    session_fullpath(session_fpath, path);
-    base_fullpath_func(base_fpath, path);
+    OP_STATS(OP_UNLINK);
+    const char *rel = layer_relpath(path); // relative to layer roots
 
     // when file exists in the session layer
-    if (access(session_fpath, F_OK) == 0) {
+    if (faccessat(session_root_fd, rel, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
         // try to delete file in session layer
-        if (unlink(session_fpath) == -1) {
+        if (unlinkat(session_root_fd, rel, 0) == -1) {
             perror("unlink: Error deleting from session layer");
             return -errno;
         }
+        // block map of a partial (sparse) copy goes with it
+        char map_rel[PATH_MAX];
+        cowmap_sidecar(map_rel, rel);
+        if (cowmap_is_sidecar(session_root_fd, map_rel))
+            unlinkat(session_root_fd, map_rel, 0);
+
+        invalidate_path(path);
         return 0;
     }
 
     // when file exists only in base layer
-    if (access(base_fpath, F_OK) == 0) {
+    if (base_layer_of(path) != -1) {
         // make sure parent directory exists in SESSION layer before creating marker
-        char *dir_end = strrchr(session_fpath, '/');
-        if (dir_end && dir_end != session_fpath) {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, session_fpath, dir_end - session_fpath);
-            dir_path[dir_end - session_fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
-        char deleted_marker[PATH_MAX];
-        snprintf(deleted_marker, PATH_MAX, "%s.deleted", session_fpath);
-        int fd = open(deleted_marker, O_WRONLY | O_CREAT, 0644);
-        if (fd == -1)
-            return -errno;
-        close(fd);
+        session_mkparent(path);
+
+        int res = whiteout_create(path);
+        if (res != 0)
+            return res;
+        invalidate_path(path);
         return 0;
     }
 
     return -ENOENT;
 }
 
+static int cow_entry_with_xattrs(const char *path, int layer);
+
 // utimensat operation func implementation (POSIX)
 #if FUSE_USE_VERSION >= 30
 int myfs_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
@@ -226,80 +264,198 @@ int myfs_utimens(const char *path, const struct timespec ts[2], struct fuse_file
 int myfs_utimens(const char *path, const struct timespec ts[2])
 {
 #endif
-    char fpath[PATH_MAX];
+    OP_STATS(OP_UTIMENS);
+    const char *rel = layer_relpath(path);
 
-    // update session layer times
-    session_fullpath(fpath, path);
+    // base only: session copy first (a stub with metacopy), like setxattr
+    struct stat st;
+    if (fstatat(session_root_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        if (errno != ENOENT)
+            return -errno;
+
+        int layer = base_layer_of(path);
+        if (layer == -1)
+            return -ENOENT;
+
+        int ret = cow_entry_with_xattrs(path, layer);
+        if (ret != 0)
+            return ret;
+    }
 
-    int res = utimensat(0, fpath, ts, AT_SYMLINK_NOFOLLOW);
+    // update session layer times
+    int res = utimensat(session_root_fd, rel, ts, AT_SYMLINK_NOFOLLOW);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+/* renaming a dir moves every path below it, cached resolutions of
+   those cant be found by prefix so drop every cache */
+static void rename_invalidate(const char *from, const char *to, int is_dir)
+{
+    if (is_dir) {
+        invalidate_all();
+        return;
+    }
+    invalidate_path(from);
+    invalidate_path(to);
+}
+
+// block map of whatever was replaced at destination, no longer applies
+static void rename_drop_map(const char *map_rel)
+{
+    if (cowmap_is_sidecar(session_root_fd, map_rel))
+        unlinkat(session_root_fd, map_rel, 0);
+}
+
+// renameat2() within the session layer, flags 0 on systems without it
+static int session_rename(const char *from, const char *to, unsigned int flags)
+{
+#ifdef __linux__
+    if (flags)
+        return syscall(SYS_renameat2, session_root_fd, from, session_root_fd, to, flags);
+#endif
+    return renameat(session_root_fd, from, session_root_fd, to);
+}
+
+/* RENAME_EXCHANGE of two session entries. block maps are swapped along,
+   a map that only one side has moves to the other name */
+static int rename_exchange(const char *rel_from, const char *rel_to,
+                           const char *map_from, const char *map_to)
+{
+    int has_from = cowmap_is_sidecar(session_root_fd, map_from);
+    int has_to = cowmap_is_sidecar(session_root_fd, map_to);
+    int res = 0;
+
+    if (session_rename(rel_from, rel_to, RENAME_EXCHANGE) == -1)
+        return -errno;
+
+    if (has_from && has_to)
+        res = session_rename(map_from, map_to, RENAME_EXCHANGE);
+    else if (has_from)
+        res = session_rename(map_from, map_to, 0);
+    else if (has_to)
+        res = session_rename(map_to, map_from, 0);
+
+    if (res == -1) {
+        // without their maps the copies would read zeros, swap them back
+        int err = errno;
+        session_rename(rel_from, rel_to, RENAME_EXCHANGE);
+        return -err;
+    }
+    return 0;
+}
+
 // rename operation func implementation
 #if FUSE_USE_VERSION >= 30
 int myfs_rename(const char *from, const char *to, unsigned int flags)
 {
-    (void) flags;
 #else
 int myfs_rename(const char *from, const char *to)
 {
+    unsigned int flags = 0;
 #endif
-    char session_from[PATH_MAX], session_to[PATH_MAX];
-    char base_from[PATH_MAX];
-
-    session_fullpath(session_from, from);
-    session_fullpath(session_to, to);
+    OP_STATS(OP_RENAME);
+    const char *rel_from = layer_relpath(from), *rel_to = layer_relpath(to);
+
+    // RENAME_WHITEOUT and anything newer cant be honored across layers
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        return -EINVAL;
+
+    // is it a directory (in whichever layer)? decides how much cache to drop
+    struct stat from_st;
+    int from_is_dir = 0;
+    int from_layer = resolve_path(from, NULL);
+    if (from_layer >= RESOLVE_SESSION &&
+        fstatat(layer_root_fd(from_layer), layer_relpath(from), &from_st, AT_SYMLINK_NOFOLLOW) == 0)
+        from_is_dir = S_ISDIR(from_st.st_mode);
+
+    // destination as the merged view sees it, base layers included
+    int to_layer = flags ? resolve_path(to, NULL) : RESOLVE_ENOENT;
+    if ((flags & RENAME_NOREPLACE) && to_layer >= RESOLVE_SESSION)
+        return -EEXIST;
+
+    char map_from[PATH_MAX], map_to[PATH_MAX];
+    cowmap_sidecar(map_from, rel_from);
+    cowmap_sidecar(map_to, rel_to);
+
+    /* both names stay, only their content swaps. a side still in a base
+       layer would have to be copied up first and its base entry masked,
+       which cant be done atomically: only session entries are exchanged */
+    if (flags & RENAME_EXCHANGE) {
+        struct stat to_st;
+
+        if (from_layer < RESOLVE_SESSION || to_layer < RESOLVE_SESSION)
+            return -ENOENT;
+        if (from_layer != RESOLVE_SESSION || to_layer != RESOLVE_SESSION)
+            return -EINVAL;
+
+        int res = rename_exchange(rel_from, rel_to, map_from, map_to);
+        int is_dir = from_is_dir ||
+            (fstatat(session_root_fd, rel_to, &to_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(to_st.st_mode));
+        rename_invalidate(from, to, is_dir);
+        return res;
+    }
 
     // make sure destination parent directory exists in session layer
-    char *dest_dir_end = strrchr(session_to, '/');
-    if (dest_dir_end && dest_dir_end != session_to) {
-        char dir_path[PATH_MAX];
-        strncpy(dir_path, session_to, dest_dir_end - session_to);
-        dir_path[dest_dir_end - session_to] = '\0';
-        mkdir(dir_path, 0755);
-    }
+    session_mkparent(to);
+
+    // source exists in session layer: rename directly, relative to session root
+    if (faccessat(session_root_fd, rel_from, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        int has_map = cowmap_is_sidecar(session_root_fd, map_from);
 
-    // source exists in session layer: rename directly
-    if (access(session_from, F_OK) == 0) {
-        if (rename(session_from, session_to) == -1)
+        if (session_rename(rel_from, rel_to, flags & RENAME_NOREPLACE) == -1)
             return -errno;
-        // if source also in base layer, mask the old path
-        if (base_fullpath_func(base_from, from) == 0) {
-            char deleted_marker[PATH_MAX];
-            snprintf(deleted_marker, PATH_MAX, "%s.deleted", session_from);
-            int fd = open(deleted_marker, O_WRONLY | O_CREAT, 0644);
-            if (fd != -1) close(fd);
+
+        if (has_map) {
+            // partial (sparse) copy takes its block map along, replacing any at destination
+            if (renameat(session_root_fd, map_from, session_root_fd, map_to) == -1) {
+                // without its map the copy would read zeros, put it back
+                int err = errno;
+                renameat(session_root_fd, rel_to, session_root_fd, rel_from);
+                rename_invalidate(from, to, from_is_dir);
+                return -err;
+            }
+        } else {
+            rename_drop_map(map_to);
         }
+        // if source also in base layer, mask the old path
+        if (base_layer_of(from) != -1)
+            whiteout_create(from);
+        rename_invalidate(from, to, from_is_dir);
         return 0;
     }
 
     // source only in base layer: CoW to new session path + mask old path
-    if (base_fullpath_func(base_from, from) == -1)
+    int layer = base_layer_of(from);
+    if (layer == -1)
         return -ENOENT;
 
     struct stat st;
-    if (lstat(base_from, &st) == -1)
+    if (fstatat(base_root_fds[layer], rel_from, &st, AT_SYMLINK_NOFOLLOW) == -1)
         return -errno;
 
     if (S_ISDIR(st.st_mode)) {
-        if (mkdir(session_to, st.st_mode & 0777) == -1 && errno != EEXIST)
+        if (mkdirat(session_root_fd, rel_to, st.st_mode & 0777) == -1 && errno != EEXIST)
             return -errno;
     } else {
         // copy (CoW) source from BASE to new session path
         // keep original mode. old path gets .deleted marker 
+        char base_from[PATH_MAX], session_to[PATH_MAX];
+        base_layer_fullpath(base_from, layer, from);
+        session_fullpath(session_to, to);
+        copyup_lock(session_to); // holds its .cowtmp. file, see copyup_lock_all()
         int cow_ret = cow_file(base_from, session_to, st.st_mode & 0666);
+        copyup_unlock(session_to);
         if (cow_ret != 0) return cow_ret;
     }
+    rename_drop_map(map_to);
 
     // mask the original path in session layer
-    char deleted_marker[PATH_MAX];
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", session_from);
-    int fd = open(deleted_marker, O_WRONLY | O_CREAT, 0644);
-    if (fd != -1) close(fd);
+    whiteout_create(from);
 
+    rename_invalidate(from, to, from_is_dir);
     return 0;
 }
 
@@ -313,86 +469,71 @@ int myfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi
 int myfs_chown(const char *path, uid_t uid, gid_t gid)
 {
 #endif
-    char fpath[PATH_MAX];
-    char base_fpath[PATH_MAX];
-
-    session_fullpath(fpath, path);
+    OP_STATS(OP_CHOWN);
+    const char *rel = layer_relpath(path);
 
     /* chown must not touch the base layer directly.
        if the file only lives in base, CoW it into session first,
        then apply ownership change to the session copy */
     struct stat st;
-    if (lstat(fpath, &st) == -1) {
+    if (fstatat(session_root_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == -1) {
         if (errno != ENOENT)
             return -errno;
 
         // not in session — look in base layers
-        if (base_fullpath_func(base_fpath, path) == -1)
+        int layer = base_layer_of(path);
+        if (layer == -1)
             return -ENOENT;
 
         // ensure parent directory exists in session layer
-        char *dir_end = strrchr(fpath, '/');
-        if (dir_end && dir_end != fpath) {
-            char dir_path[PATH_MAX];
-            strncpy(dir_path, fpath, dir_end - fpath);
-            dir_path[dir_end - fpath] = '\0';
-            mkdir(dir_path, 0755);
-        }
+        session_mkparent(path);
 
-        if (lstat(base_fpath, &st) == -1)
+        if (fstatat(base_root_fds[layer], rel, &st, AT_SYMLINK_NOFOLLOW) == -1)
             return -errno;
 
         if (S_ISLNK(st.st_mode)) {
             // symlink CoW: read target then recreate in session
             char link_target[PATH_MAX];
-            ssize_t len = readlink(base_fpath, link_target, sizeof(link_target) - 1);
+            ssize_t len = readlinkat(base_root_fds[layer], rel, link_target, sizeof(link_target) - 1);
             if (len == -1) return -errno;
             link_target[len] = '\0';
-            if (symlink(link_target, fpath) == -1 && errno != EEXIST)
+            if (symlinkat(link_target, session_root_fd, rel) == -1 && errno != EEXIST)
                 return -errno;
         } else if (S_ISDIR(st.st_mode)) {
-            if (mkdir(fpath, st.st_mode & 0777) == -1 && errno != EEXIST)
+            if (mkdirat(session_root_fd, rel, st.st_mode & 0777) == -1 && errno != EEXIST)
                 return -errno;
         } else {
-            // CoW copy file to session before chown
+            // CoW copy file to session before chown, keeping its mode
             // after that, lchown on session copy.
-            int cow_ret = cow_file(base_fpath, fpath, 0644);
-            if (cow_ret != 0) return cow_ret;
+            char fpath[PATH_MAX], base_fpath[PATH_MAX];
+            session_fullpath(fpath, path);
+            base_layer_fullpath(base_fpath, layer, path);
+            int cow_ret = copy_up_meta(base_fpath, fpath, st.st_mode & 0777);
+            if (cow_ret < 0) return cow_ret;
         }
     }
 
+    invalidate_path(path);
+
     // apply ownership change to session copy
-    // lchown doesn't go through symlinks. change symlink itself if one
-    if (lchown(fpath, uid, gid) == -1)
+    // AT_SYMLINK_NOFOLLOW like lchown: change symlink itself if one
+    if (fchownat(session_root_fd, rel, uid, gid, AT_SYMLINK_NOFOLLOW) == -1)
         return -errno;
     return 0;
 }
 // symlinks go to session layer never modifying base
 int myfs_symlink(const char *target, const char *linkpath)
 {
-    char session_fpath[PATH_MAX];
-    session_fullpath(session_fpath, linkpath);
-    /*translates virtual path into real path on disk inside session dir. 
-      so for example /mylink becomes /path/to/session/mylink.*/
-
-
-    // create parent dirs in session (if applicable):
+    OP_STATS(OP_SYMLINK);
 
-    /*strrchr finds last / in full session path, everything before is parent dir. 
-    for example: if session_fpath is /session/subdir/mylink then dir_end points to /mylink part, so dir_path is /session/subdir. 
-    mkdir creates it. */
-    char *dir_end = strrchr(session_fpath, '/');
-
-    // dir_end != session_fpath avoids creating root itself /
-    if (dir_end && dir_end != session_fpath) { 
-        char dir_path[PATH_MAX];
-        strncpy(dir_path, session_fpath, dir_end - session_fpath);
-        dir_path[dir_end - session_fpath] = '\0';
-        mkdir(dir_path, 0755);
-    }
+    // create parent dir in session (if applicable), "/mylink" needs none
+    session_mkparent(linkpath);
 
-    if (symlink(target, session_fpath) == -1)
+    // link goes relative to session root: /mylink -> <session>/mylink
+    if (symlinkat(target, session_root_fd, layer_relpath(linkpath)) == -1)
         return -errno;
+
+    invalidate_path(linkpath);
     return 0;
 }
 
@@ -400,100 +541,96 @@ int myfs_symlink(const char *target, const char *linkpath)
 // reading symlink target. checks session and .deleted markers, then falls back to base layers
 int myfs_readlink(const char *path, char *buf, size_t size)
 {
-    char fpath[PATH_MAX];
-
-    // check session layer
-    session_fullpath(fpath, path);
-
-    // is there a .deleted marker?
-    char deleted_marker[PATH_MAX];
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
-    if (access(deleted_marker, F_OK) == 0)
+    OP_STATS(OP_READLINK);
+    // whiteout, session, then base layers (cached)
+    int layer = resolve_path(path, NULL);
+    if (layer < RESOLVE_SESSION)
         return -ENOENT;
 
-    /*call readlink on session path. readlink syscall reads what symlink points to 
+    // indexed base layer stores the target
+    if (layer >= 0 && base_manifests[layer]) {
+        const struct manifest_entry *e = manifest_find(base_manifests[layer], path);
+        if (e && S_ISLNK(e->mode)) {
+            snprintf(buf, size, "%s", manifest_target(base_manifests[layer], e));
+            return 0;
+        }
+    }
+
+    /*call readlink on resolved path. readlink syscall reads what symlink points to 
     and if file exists there then returns number of bytes written, 
     so res != -1 means success. 
     */
     // readlink does not follow the link, reads its target
-    ssize_t res = readlink(fpath, buf, size - 1);
-    if (res != -1) {
-        buf[res] = '\0'; // readlink doesnt null terminate, must do it manually
-        return 0;
-    }
-    if (errno != ENOENT)
+    ssize_t res = readlinkat(layer_root_fd(layer), layer_relpath(path), buf, size - 1);
+    if (res == -1)
         return -errno;
 
-    // base layers
-    if (base_fullpath_func(fpath, path) == 0) {
-        res = readlink(fpath, buf, size - 1);
-        if (res == -1)
-            return -errno;
-        buf[res] = '\0';
-        return 0;
-    }
-
-    return -ENOENT;
+    buf[res] = '\0'; // readlink doesnt null terminate, must do it manually
+    return 0;
 }
 
 /* 
 // helper func - CoW any type of BASE entry into session, 
 // copying existing xattrs. used by setxattr and removexattr 
-// before modifying xattrs.
+// before modifying xattrs. layer = base layer holding path.
 // 
 */
-static int cow_entry_with_xattrs(const char *path,
-                                  const char *session_fpath,
-                                  const char *base_fpath)
+static int cow_entry_with_xattrs(const char *path, int layer)
 {
-    // create parent dirs in session, find last / in session path 
-    // (everything before is parent dir) and create with mkdir
-    char *dir_end = strrchr(session_fpath, '/');
+    const char *rel = layer_relpath(path);
 
-    if (dir_end && dir_end != session_fpath/* dont mkdir root / */) 
-    {
-        char dir_path[PATH_MAX];
-    
-        strncpy(dir_path, session_fpath, dir_end - session_fpath);
-        dir_path[dir_end - session_fpath] = '\0';
-        mkdir(dir_path, 0755);
-    }
+    // create parent dir in session
+    int res = session_mkparent(path);
+    if (res != 0)
+        return res;
 
     struct stat st;
     
     // get file type and permissions for what will be CoW copied
-    if (lstat(base_fpath, &st) == -1) 
+    if (fstatat(base_root_fds[layer], rel, &st, AT_SYMLINK_NOFOLLOW) == -1) 
      return -errno;
 
+    char session_fpath[PATH_MAX], base_fpath[PATH_MAX];
+    session_fullpath(session_fpath, path);
+    base_layer_fullpath(base_fpath, layer, path);
+
     if (S_ISLNK(st.st_mode)) // if symlink, cant use open(), read(), etc 
-    // instead using readlink() to see what symlink points to and symlink() 
+    // instead using readlinkat() to see what symlink points to and symlinkat() 
     // to create it in session
     {
         char link_target[PATH_MAX];
 
-        ssize_t len = readlink(base_fpath, link_target, sizeof(link_target) - 1);
+        ssize_t len = readlinkat(base_root_fds[layer], rel, link_target, sizeof(link_target) - 1);
     
         if (len == -1) 
          return -errno;
         
          link_target[len] = '\0';
         
-         if (symlink(link_target, session_fpath) == -1 && errno != EEXIST)
+         if (symlinkat(link_target, session_root_fd, rel) == -1 && errno != EEXIST)
             return -errno;
     } else if (S_ISDIR(st.st_mode)) { // if directory
         // dirs have nothing to copy, simply create them in session with same permissions
-        if (mkdir(session_fpath, st.st_mode & 0777) == -1 && errno != EEXIST)
+        if (mkdirat(session_root_fd, rel, st.st_mode & 0777) == -1 && errno != EEXIST)
             return -errno;
     } else { // if regular file
-        // cow_file() to copy content 
-        if (cow_file(base_fpath, session_fpath, st.st_mode & 0666) != 0)
+        // content (or only a stub with metacopy), 1 = another thread just did
+        int cow_ret = copy_up_meta(base_fpath, session_fpath, st.st_mode & 0666);
+        if (cow_ret < 0)
             return -EIO;
+        if (cow_ret == 1) {
+            invalidate_path(path);
+            return 0;
+        }
     }
 
     // copy existing xattrs for session copy
     // before caller of this func modifies or removes
     cow_xattrs(base_fpath, session_fpath);
 
+    // session copy now serves this path
+    invalidate_path(path);
+
     return 0;
 }
 
@@ -504,27 +641,23 @@ static int cow_entry_with_xattrs(const char *path,
 #ifdef __APPLE__
 int myfs_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t position)
 {
+    OP_STATS(OP_GETXATTR);
     (void) position; // 0 for normal attributes
 #else
 int myfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+    OP_STATS(OP_GETXATTR);
 #endif
     char fpath[PATH_MAX];
-    session_fullpath(fpath, path);
-
-    // check .deleted marker to not return xattr for deleted files
-    char deleted_marker[PATH_MAX];
 
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
-   
-    if (access(deleted_marker, F_OK) == 0)
+    // whiteout masks xattrs too, otherwise read from whichever layer serves path
+    if (resolve_path(path, fpath) < RESOLVE_SESSION)
         return -ENOENT;
 
-    // try session layer
     ssize_t res;
 
 #ifdef __APPLE__
-    // read xattr with name from session path to get num of bytes
+    // read xattr with name from resolved path to get num of bytes
     // of "value" or -1 on error
     res = getxattr(fpath, name, value, size, 0, XATTR_NOFOLLOW);
 #else
@@ -534,27 +667,9 @@ int myfs_getxattr(const char *path, const char *name, char *value, size_t size)
     // success
     if (res != -1) 
      return (int)res;
-    
-    // error (other than file not found or exists but no xattr with that name)
-    if (errno != ENOATTR && errno != ENOENT) 
-     return -errno;
-
-    // if xattr not in session, check base layers
-    if (base_fullpath_func(fpath, path) == 0) {
-#ifdef __APPLE__
-        res = getxattr(fpath, name, value, size, 0, XATTR_NOFOLLOW);
-#else
-        res = lgetxattr(fpath, name, value, size);
-#endif
-        // found, return bytes 
-        if (res != -1) 
-         return (int)res;
-        
-         // exists in base but no xattr or any other error
-         return -errno;
-    }
 
-    return -ENOATTR;
+    // exists but no xattr with that name, or any other error
+    return -errno;
 }
 
 // setxattr operation func implementation
@@ -562,10 +677,12 @@ int myfs_getxattr(const char *path, const char *name, char *value, size_t size)
 #ifdef __APPLE__
 int myfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position)
 {
+    OP_STATS(OP_SETXATTR);
     (void) position;
 #else
 int myfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
+    OP_STATS(OP_SETXATTR);
 #endif
 
     char session_fpath[PATH_MAX];
@@ -573,20 +690,20 @@ int myfs_setxattr(const char *path, const char *name, const char *value, size_t
 
     // if file not in session yet, CoW it with its xattrs first
     struct stat st;
-    // does file exist in session? if lstat fails, file's not there.
-    if (lstat(session_fpath, &st) == -1) {
+    // does file exist in session? if fstatat fails, file's not there.
+    if (fstatat(session_root_fd, layer_relpath(path), &st, AT_SYMLINK_NOFOLLOW) == -1) {
 
         // other than "file not found", exit as theres real error
         if (errno != ENOENT) 
          return -errno;
 
-        char base_fpath[PATH_MAX];
+        int layer = base_layer_of(path);
 
-        if (base_fullpath_func(base_fpath, path) == -1) 
+        if (layer == -1) 
          return -ENOENT;
 
         /* copy file into session, with xattrs */
-        int ret = cow_entry_with_xattrs(path, session_fpath, base_fpath);
+        int ret = cow_entry_with_xattrs(path, layer);
         
         // when above is called session_fpath is on disk with content and xattrs
         if (ret != 0) 
@@ -616,21 +733,20 @@ int myfs_listxattr(const char *path, char *list, size_t size)
 { // size param has 2 modes handled internally by syscall:
   // can be size 0 and list NULL - get only byte size needed by FUSE
   // >0 and list not NULL - fill the buffer and get byte size written
+    OP_STATS(OP_LISTXATTR);
     char fpath[PATH_MAX];
-    session_fullpath(fpath, path);
 
-    // check .deleted marker
-    char deleted_marker[PATH_MAX];
-
-    snprintf(deleted_marker, PATH_MAX, "%s.deleted", fpath);
-    
-    if (access(deleted_marker, F_OK) == 0)
+    // whiteout or not found in any layer, 0 xattrs
+    int layer = resolve_path(path, fpath);
+    if (layer == RESOLVE_WHITEOUT)
         return -ENOENT;
+    if (layer == RESOLVE_ENOENT)
+        return 0;
 
     ssize_t res;
 
 #ifdef __APPLE__
-    // on session path
+    // on resolved path
     res = listxattr(fpath, list, size, XATTR_NOFOLLOW);
 #else
     // non-Apple
@@ -640,53 +756,36 @@ int myfs_listxattr(const char *path, char *list, size_t size)
     // success, get bytes
     if (res != -1) 
      return (int)res;
-    
-    // stop if anything other than "file not found" in session
-    if (errno != ENOENT) 
-      return -errno;
-
-    // search base layers
-    if (base_fullpath_func(fpath, path) == 0) {
-#ifdef __APPLE__
-        res = listxattr(fpath, list, size, XATTR_NOFOLLOW);
-#else
-        res = llistxattr(fpath, list, size);
-#endif
-       
-        if (res != -1) 
-         return (int)res;
-        
-        return -errno; // something went wrong reading xattrs, return what
-    }
 
-    return 0; // file not found in any layer, 0 xattrs
+    return -errno; // something went wrong reading xattrs, return what
 }
 
 // removexattr operation func implementation
 // CoWs file into session with existing xattrs, then remove "attr"
 int myfs_removexattr(const char *path, const char *name)
 {
+    OP_STATS(OP_REMOVEXATTR);
     char session_fpath[PATH_MAX];
     session_fullpath(session_fpath, path);
 
     // if file not in session yet, CoW it with its xattrs first
     struct stat st;
 
-    if (lstat(session_fpath, &st) == -1) 
+    if (fstatat(session_root_fd, layer_relpath(path), &st, AT_SYMLINK_NOFOLLOW) == -1) 
     { // does file exist in session
 
         // if not, stop (assuming error is other than "file not found")
         if (errno != ENOENT) 
          return -errno;
         
-        char base_fpath[PATH_MAX];
+        int layer = base_layer_of(path);
         
         // not in BASE, return "not found"
-        if (base_fullpath_func(base_fpath, path) == -1) 
+        if (layer == -1) 
          return -ENOENT;
 
         // file in BASE, CoW it into session with xattrs
-        int ret = cow_entry_with_xattrs(path, session_fpath, base_fpath);
+        int ret = cow_entry_with_xattrs(path, layer);
         
         if (ret != 0) 
          return ret;
@@ -19,13 +19,20 @@
 #ifndef PRISMAFS_H
 #define PRISMAFS_H
 
+// Linux: copy_file_range, O_PATH, renameat2 and friends live behind this
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #if defined(__linux__)
 #define FUSE_USE_VERSION 30
 #else
 #define FUSE_USE_VERSION 29
 #endif
 #define PRISMAFS_VERSION "1.6.0"
-#define MAX_BASE_LAYERS 10
+
+// per base layer flags (base_flags[])
+#define LAYER_READONLY  0x1   // "base <path> readonly": never changes while mounted
 
 #include <fuse.h>
 #include <stdio.h>
@@ -45,6 +52,7 @@
 #endif
 #include <sys/utsname.h>
 #include <stdint.h>
+#include <pthread.h>
 
 // ENOATTR = "xattr not found" error on macOS
 // ENODATA on Linux
@@ -64,38 +72,407 @@
    GLOBAL LAYER STATE (definitions in layers.c)
    -------------------------------------------------------------
 */
-extern char base_paths[MAX_BASE_LAYERS][PATH_MAX];
-extern int  num_base_layers;
+extern char **base_paths;      // grown by layers_add(), any number of layers
+extern int  *base_flags;
+extern int   num_base_layers;
 extern char session_path[PATH_MAX];
 
-/* -------------------
- readdir reads entries from session layer, every base layer. 
-  Same filename might appear in more layers, normally base and session(s).
-  Need to track what is already added in linked list and FUSE, 
-  so it doesnt get duplicates listed. 
-  Linked list to track:
-  -------------------*/
-struct filename_node {
-    char *name;
-    struct filename_node *next;
+/* -------------------------------------------------------------
+   FILENAME SET (nameset.c)
+   readdir reads entries from session layer, every base layer.
+   Same filename might appear in more layers, normally base and session(s).
+   Need to track what is already added to FUSE so it doesnt get
+   duplicates listed. hash set, names live in an arena freed at once.
+   -------------------------------------------------------------
+*/
+struct name_arena {
+    struct arena_chunk *head;
+};
+
+struct nameset {
+    const char **names;        // slot -> name in arena, NULL = empty
+    uint64_t *hashes;          // slot -> cached hash of name
+    size_t cap;                // slots, power of 2
+    size_t count;              // names stored
+    struct name_arena arena;
+};
+
+char *arena_strdup(struct name_arena *arena, const char *s, size_t len);
+void arena_free(struct name_arena *arena);
+void nameset_init(struct nameset *set);
+int  nameset_contains(const struct nameset *set, const char *name);
+int  nameset_add(struct nameset *set, const char *name);
+void nameset_free(struct nameset *set);
+
+/* -------------------------------------------------------------
+   OPEN FILE HANDLES (ops_file.c)
+   open/create resolve the layer once and keep the backing fd here,
+   so read/write/flush/fsync use it directly instead of resolving
+   and re-opening the file on every request. lives in fi->fh.
+   -------------------------------------------------------------
+*/
+struct cowmap;
+
+struct myfs_handle {
+    int fd;                  // backing fd, session copy or base layer file
+    int in_session;          // 0 while fd still points into a base layer
+    uint64_t gen;            // entry_gen when a base fd was last checked for a copy-up
+    struct vcontent *vc;     // /dev file content (fd = -1), NULL for layer files
+    int base_fd;             // base fd replaced by copy-up, -1 = none. kept until
+                             // release, read_buf replies may still splice from it
+    struct cowmap *map;      // set while session copy is partial (sparse copy-up)
+    int flags;               // open flags as passed by FUSE
+    pthread_rwlock_t lock;   // readers share it, copy-up swaps fd under write lock
+    char path[];             // virtual path, needed for copy-up on first write
+};
+
+int handle_getattr(struct fuse_file_info *fi, struct stat *st); // 1 = no backing file
+
+/* -------------------------------------------------------------
+   COPY-UP STATS (layers.c)
+   cow_file() picks the fastest copy method that works, counts
+   copies and bytes per method. updated with atomics.
+   -------------------------------------------------------------
+*/
+enum {
+    COW_REFLINK,            // FICLONE, shares extents
+    COW_COPY_FILE_RANGE,
+    COW_SENDFILE,
+    COW_READWRITE,          // userspace loop fallback
+    COW_SPARSE,             // block map created, bytes = blocks filled since
+    COW_METHODS
+};
+
+struct cow_stats {
+    uint64_t count[COW_METHODS];
+    uint64_t bytes[COW_METHODS];
+};
+
+extern struct cow_stats cow_stats;
+
+/* -------------------------------------------------------------
+   SPARSE COPY-UP (cowmap.c)
+   "cow_mode sparse": session copy is created sparse and a bitmap in
+   <file>.cowmap says which blocks were copied from base so far.
+   "metacopy on": metadata changes leave such a copy with no block yet.
+   -------------------------------------------------------------
+*/
+#define COW_MODE_FULL   0
+#define COW_MODE_SPARSE 1
+
+extern int      cow_mode;
+extern uint64_t cow_block;
+extern int      metacopy;
+
+void cowmap_sidecar(char out[PATH_MAX], const char *session_fpath);
+int  cowmap_is_sidecar(int dirfd, const char *name);
+int  cowmap_create(const char *base_fpath, const char *session_fpath, mode_t mode);
+int  cowmap_open(const char *path, int session_fd, struct cowmap **mp);
+void cowmap_put(struct cowmap *m);
+int  cowmap_fill(struct cowmap *m, int session_fd, off_t off, size_t len);
+ssize_t cowmap_read(struct cowmap *m, int session_fd, char *buf, size_t size, off_t off);
+size_t cowmap_extent(struct cowmap *m, int session_fd, off_t pos, size_t size, int *fd);
+int  cowmap_truncate(struct cowmap *m, int session_fd, off_t size);
+int  copy_up_data(const char *base_fpath, const char *session_fpath, mode_t mode); // 1 = was already there
+int  copy_up_meta(const char *base_fpath, const char *session_fpath, mode_t mode);
+
+/* -------------------------------------------------------------
+   OPERATION STATS (stats.c)
+   OP_STATS(op) at the top of an op times it until the op returns,
+   counters are per thread, /dev/stats shows the sums
+   -------------------------------------------------------------
+*/
+enum {
+    OP_LOOKUP, OP_GETATTR, OP_ACCESS, OP_READLINK, OP_READDIR, OP_OPEN, OP_CREATE,
+    OP_READ, OP_WRITE, OP_TRUNCATE, OP_FLUSH, OP_RELEASE, OP_FSYNC, OP_STATFS,
+    OP_UNLINK, OP_RENAME, OP_MKDIR, OP_RMDIR, OP_SYMLINK, OP_CHMOD, OP_CHOWN,
+    OP_UTIMENS, OP_GETXATTR, OP_SETXATTR, OP_LISTXATTR, OP_REMOVEXATTR,
+    OP_COUNT
+};
+
+struct op_timer {
+    int op;
+    uint64_t start;     // monotonic ns
 };
 
+#define OP_STATS(op) \
+    struct op_timer op_timer__ __attribute__((cleanup(stats_op_end))) = stats_op_begin(op)
+
+struct op_timer stats_op_begin(int op);
+void  stats_op_end(struct op_timer *t);
+void  stats_layer_hit(int layer);
+char *stats_render(size_t *len);
+
+/* -------------------------------------------------------------
+   SYNTHETIC /dev FILES (vfile.c)
+   registry of read-only files under /dev, content generated at open
+   -------------------------------------------------------------
+*/
+#define VFILE_FOREVER -1.0  // content never changes while mounted
+
+struct vfile {
+    const char *name;                  // file name under /dev
+    mode_t mode;
+    double ttl;                        // seconds content is reused, 0 = every open
+    char *(*generate)(size_t *len);    // malloc'd content, NULL = out of memory
+};
+
+// one generated snapshot, shared by the cache and open handles
+struct vcontent {
+    int refs;
+    size_t len;
+    char *data;
+};
+
+// growing text buffer for generators
+struct textbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+#define TEXTBUF_INIT { NULL, 0, 0 }
+
+extern const struct vfile vfiles[];   // terminated by name == NULL
+
+const struct vfile *vfile_lookup(const char *path);
+struct vcontent *vfile_content(const struct vfile *vf);
+void vcontent_put(struct vcontent *vc);
+void vfile_getattr(const struct vfile *vf, struct stat *stbuf);
+void textbuf_printf(struct textbuf *tb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* -------------------------------------------------------------
+   STATFS (ops_file.c)
+   free space of the session layer, total from "statfs_total"
+   -------------------------------------------------------------
+*/
+#define STATFS_TOTAL_SESSION 0 // size of session fs
+#define STATFS_TOTAL_SUM     1 // session fs + used space on base layer filesystems
+#define STATFS_TOTAL_FIXED   2 // statfs_total_bytes
+
+extern int      statfs_total;
+extern uint64_t statfs_total_bytes;
+extern double   statfs_ttl;
+
 /* -------------------------------------------------------------
    LAYER HELPERS (layers.c) 
    -------------------------------------------------------------
 */
+#define COW_TMP_PREFIX ".cowtmp." // copy in progress, renamed into place when done
+
+extern int session_root_fd;                  // layer roots, see layers_open()
+extern int *base_root_fds;                   // num_base_layers entries
+
+int  layers_add(const char *path, int flags);
+int  layers_open(void);
+const char *layer_relpath(const char *path);
+int  layer_root_fd(int layer);
+int  all_base_readonly(void);
 void session_fullpath(char fpath[PATH_MAX], const char *path);
+void base_layer_fullpath(char fpath[PATH_MAX], int layer, const char *path);
 int  base_fullpath_func(char fpath[PATH_MAX], const char *path);
-int  is_in_list(struct filename_node *list, const char *name);
-void add_to_list(struct filename_node **list_ptr, const char *name);
+int  base_layer_of(const char *path);
+int  session_mkparent(const char *path);
+int  whiteout_create(const char *path);
 int  cow_file(const char *src, const char *dst, mode_t mode);
+int  cow_tmpfile(char tmp[PATH_MAX], const char *dst, mode_t mode);
+void copyup_lock(const char *session_fpath);
+void copyup_unlock(const char *session_fpath);
+void copyup_lock_all(void);
+void copyup_unlock_all(void);
+const char *cow_method_name(int method);
+void cow_count(int method, uint64_t count, off_t bytes);
 int  cow_xattrs(const char *src, const char *dst);
 
+/* -------------------------------------------------------------
+   RESOLVED-PATH LOOKUP CACHE (cache.c)
+   resolve_path() returns where a virtual path lives: a base layer
+   index (>= 0) or one of the codes below. ops that change what a path
+   resolves to must call lookup_invalidate()/lookup_flush().
+   -------------------------------------------------------------
+*/
+#define RESOLVE_SESSION  -1
+#define RESOLVE_WHITEOUT -2   // masked by <path>.deleted in session
+#define RESOLVE_ENOENT   -3   // not in any layer
+
+extern double lookup_ttl;
+extern size_t lookup_cache_slots;
+extern double negative_ttl;           // paths found in no layer, own table
+extern size_t negative_cache_slots;
+
+uint64_t path_hash(const char *s);
+double monotonic_now(void);
+void lookup_cache_init(void);
+int  resolve_path(const char *path, char *fpath); // fpath may be NULL
+void lookup_invalidate(const char *path);
+void lookup_flush(void);
+void parent_path(char parent[PATH_MAX], const char *path);
+void invalidate_path(const char *path);
+void invalidate_all(void);
+
+extern uint64_t entry_gen;      // bumped by invalidate_path/_all
+extern uint64_t namespace_gen;  // bumped by invalidate_all
+
+/* -------------------------------------------------------------
+   MERGED DIRECTORY LISTINGS (dircache.c)
+   dirlist is immutable once built and refcounted, dircache holds
+   listings by virtual dir path when every base layer is readonly.
+   -------------------------------------------------------------
+*/
+struct dirlist_entry {
+    const char *name;       // in dirlist arena
+    ino_t ino;
+    unsigned char type;     // DT_* as from readdir
+    int layer;              // where the merge found it, RESOLVE_ENOENT = virtual
+};
+
+struct dirlist {
+    int refs;
+    size_t count, cap;
+    struct dirlist_entry *entries;
+    struct name_arena arena;
+};
+
+extern size_t dircache_slots;
+
+struct dirlist *dirlist_new(void);
+int  dirlist_append(struct dirlist *dl, const char *name, ino_t ino, unsigned char type,
+                    int layer);
+void dirlist_get(struct dirlist *dl);
+void dirlist_put(struct dirlist *dl);
+void dircache_init(void);
+struct dirlist *dircache_get(const char *path);
+uint64_t dircache_generation(void);
+void dircache_store(const char *path, struct dirlist *dl, uint64_t gen);
+void dircache_invalidate(const char *path);
+void dircache_flush(void);
+
+/* -------------------------------------------------------------
+   DIRECTORY SCANNING (dirscan.c)
+   getdents64 into a large per-thread buffer, names passed in place
+   -------------------------------------------------------------
+*/
+typedef int (*dir_scan_fn)(const char *name, ino_t ino, unsigned char type, void *arg);
+
+int dir_scan(int dirfd, const char *rel, dir_scan_fn fn, void *arg);
+int dir_scan_error(int res);
+
+/* -------------------------------------------------------------
+   WORKER POOL (workpool.c)
+   runs fn(arg, 0..n-1) on merge_threads threads plus the submitter,
+   used to scan the base layers of one readdir concurrently
+   -------------------------------------------------------------
+*/
+struct work_job {
+    void (*fn)(void *arg, int index);
+    void *arg;
+    int n;
+    int next, done;            // guarded by the pool lock
+    struct work_job *qnext;
+};
+
+extern int merge_threads;
+
+void workpool_submit(struct work_job *job);
+void workpool_wait(struct work_job *job);
+
+/* -------------------------------------------------------------
+   LAYER OWNER INDEX (layerindex.c)
+   per virtual dir: name -> first base layer holding it, so resolving
+   doesnt stat every base layer in turn. readonly base layers only.
+   -------------------------------------------------------------
+*/
+#define OWNER_UNKNOWN    -4   // no index, caller walks the layers
+
+extern size_t layer_index_slots;
+
+struct owner_dir;
+
+void layer_index_init(void);
+int  layer_index_owner(const char *dir, const char *name);
+int  layer_index_owner_path(const char *path);
+struct owner_dir *layer_index_dir(const char *dir);
+int  layer_index_lookup(const struct owner_dir *d, const char *name);
+void layer_index_put(struct owner_dir *d);
+
+/* -------------------------------------------------------------
+   BASE LAYER MANIFEST (manifest.c)
+   "prismafs index" snapshot of a base layer, mmap'd from
+   "base <path> index=<file>". lookups, getattr and readdir of that
+   layer read it instead of the filesystem.
+   -------------------------------------------------------------
+*/
+struct manifest_entry {
+    uint64_t path_off;     // virtual path in the string area
+    uint64_t target_off;   // symlink target, 0 = none
+    uint64_t size;
+    uint64_t ino;
+    int64_t  mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint32_t uid, gid;
+    uint32_t nlink;
+    uint16_t parent_len;   // path[0, parent_len) is the parent dir
+    uint16_t name_at;      // path + name_at is the name
+};
+
+struct manifest;
+
+extern struct manifest **base_manifests;  // per base layer, NULL = no index
+
+struct manifest *manifest_open(const char *file);
+int  manifest_write(const char *basedir, const char *out);
+const struct manifest_entry *manifest_find(const struct manifest *m, const char *path);
+const struct manifest_entry *manifest_find_at(const struct manifest *m, const char *dir,
+                                              const char *name);
+const struct manifest_entry *manifest_children(const struct manifest *m, const char *dir,
+                                               size_t *count);
+const char *manifest_path(const struct manifest *m, const struct manifest_entry *e);
+const char *manifest_name(const struct manifest *m, const struct manifest_entry *e);
+const char *manifest_target(const struct manifest *m, const struct manifest_entry *e);
+int  manifest_scan(const struct manifest *m, const char *dir, dir_scan_fn fn, void *arg);
+void manifest_stat(const struct manifest_entry *e, struct stat *st);
+
+/* -------------------------------------------------------------
+   KERNEL CACHE (ops_meta.c)
+   timeouts and cache flags handed to the kernel at mount, from config
+   -------------------------------------------------------------
+*/
+struct kernel_cache_opts {
+    double entry_timeout;       // name -> inode
+    double attr_timeout;        // stat results
+    double negative_timeout;    // "doesnt exist", 0 = dont cache, < 0 = kcache_defaults()
+    double readonly_timeout;    // entries from readonly base layers, 0 = off
+    int kernel_cache;           // keep page cache across opens
+    int auto_cache;             // drop page cache when mtime/size changed
+    int use_ino;                // report layer inode numbers
+};
+
+extern struct kernel_cache_opts kcache;
+
+double kcache_timeout(int layer, double dflt);
+void kcache_defaults(void);
+#if FUSE_USE_VERSION >= 30
+void conn_want(struct fuse_conn_info *conn);
+#endif
+
+/* -------------------------------------------------------------
+   LOW-LEVEL BACKEND (lowlevel.c, Linux only)
+   "backend lowlevel": inode table with per-directory layer fds,
+   lookups relative to the parent instead of full path walks
+   -------------------------------------------------------------
+*/
+#ifdef __linux__
+extern int use_lowlevel;
+int lowlevel_main(int argc, char *argv[]);
+#endif
+
 /* -------------------------------------------------------------
    FUSE operation signatures (differences FUSE2(macOS) vs FUSE3(Linux)
    -------------------------------------------------------------
 */
 #if FUSE_USE_VERSION >= 30
+void *myfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
 int myfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi,
@@ -106,6 +483,7 @@ int myfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi
 int myfs_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi);
 int myfs_rename(const char *from, const char *to, unsigned int flags);
 #else
+void *myfs_init(struct fuse_conn_info *conn);
 int myfs_getattr(const char *path, struct stat *stbuf);
 int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi);
@@ -119,16 +497,25 @@ int myfs_rename(const char *from, const char *to);
 int myfs_access(const char *path, int mask);
 int myfs_open(const char *path, struct fuse_file_info *fi);
 int myfs_statfs(const char *path, struct statvfs *stbuf);
+int myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi);
 int myfs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi);
 int myfs_write(const char *path, const char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi);
+int myfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi);
 int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int myfs_opendir(const char *path, struct fuse_file_info *fi);
+int myfs_releasedir(const char *path, struct fuse_file_info *fi);
 int myfs_mkdir(const char *path, mode_t mode);
 int myfs_rmdir(const char *path);
 int myfs_unlink(const char *path);
 int myfs_symlink(const char *target, const char *linkpath);
 int myfs_readlink(const char *path, char *buf, size_t size);
+int myfs_flush(const char *path, struct fuse_file_info *fi);
+int myfs_release(const char *path, struct fuse_file_info *fi);
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
 
 // xattr signatures, macOS FUSE has additional "uint32_t position" in getxattr/setxattr
 // listxattr and removexattr same sig on both
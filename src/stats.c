@@ -0,0 +1,244 @@
+/* ============================================================
+   PrismaFS - stats.c
+   Per-operation counters and latency histograms for /dev/stats
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#include <time.h>
+
+/* -------------------------------------------------------------
+   every FUSE worker thread owns a stats block and is the only one
+   writing it, so counting is plain stores (relaxed atomics, no lock
+   prefix, no shared cache line between threads). reading /dev/stats
+   walks all blocks and sums them up.
+
+   latency goes into log2 buckets of nanoseconds: bucket b counts calls
+   that took [2^b, 2^(b+1)) ns. percentiles are reported as the upper
+   bound of the bucket they fall into (capped at max), so they are
+   within a factor 2.
+
+   threads libfuse retires (idle worker pool) fold their numbers into
+   stats_retired on exit, nothing gets lost.
+   -------------------------------------------------------------
+*/
+
+#define STATS_BUCKETS 40                  // 2^40 ns = ~18 min, anything slower lands in the last
+#define LAYER_SLOTS   (num_base_layers + 3) // ENOENT, whiteout, session, base layers
+
+struct op_counter {
+    uint64_t calls;
+    uint64_t ns_total;
+    uint64_t ns_max;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+struct thread_stats {
+    struct op_counter ops[OP_COUNT];
+    struct thread_stats *next;
+    uint64_t layer_hits[];  // LAYER_SLOTS, index = layer code + 3
+};
+
+static const char *op_names[OP_COUNT] = {
+    "lookup", "getattr", "access", "readlink", "readdir", "open", "create",
+    "read", "write", "truncate", "flush", "release", "fsync", "statfs",
+    "unlink", "rename", "mkdir", "rmdir", "symlink", "chmod", "chown",
+    "utimens", "getxattr", "setxattr", "listxattr", "removexattr"
+};
+
+static struct thread_stats *stats_threads = NULL;  // live threads
+static struct thread_stats *stats_retired;         // threads that exited
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static double stats_started;
+
+static __thread struct thread_stats *my_stats = NULL;
+
+// single writer, readers only need to not see torn values
+#define STAT_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(var)    __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// zeroed block sized for the layer stack, NULL = out of memory
+static struct thread_stats *stats_alloc(void)
+{
+    return calloc(1, sizeof(struct thread_stats) + LAYER_SLOTS * sizeof(uint64_t));
+}
+
+static void stats_fold(struct thread_stats *dst, struct thread_stats *src)
+{
+    for (int op = 0; op < OP_COUNT; op++) {
+        struct op_counter *d = &dst->ops[op], *s = &src->ops[op];
+        d->calls    += STAT_GET(s->calls);
+        d->ns_total += STAT_GET(s->ns_total);
+        if (STAT_GET(s->ns_max) > d->ns_max)
+            d->ns_max = STAT_GET(s->ns_max);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            d->hist[b] += STAT_GET(s->hist[b]);
+    }
+    for (int i = 0; i < LAYER_SLOTS; i++)
+        dst->layer_hits[i] += STAT_GET(src->layer_hits[i]);
+}
+
+// thread exit: keep its numbers, unlink and free its block
+static void stats_thread_exit(void *arg)
+{
+    struct thread_stats *ts = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    if (stats_retired)
+        stats_fold(stats_retired, ts);
+    for (struct thread_stats **pp = &stats_threads; *pp; pp = &(*pp)->next) {
+        if (*pp == ts) {
+            *pp = ts->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(ts);
+}
+
+static void stats_init_once(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+    stats_retired = stats_alloc();
+    stats_started = monotonic_now();
+}
+
+// stats block of the calling thread, registered on first use. NULL = out of memory
+static struct thread_stats *stats_mine(void)
+{
+    if (my_stats)
+        return my_stats;
+
+    pthread_once(&stats_once, stats_init_once);
+    struct thread_stats *ts = stats_alloc();
+    if (!ts)
+        return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    ts->next = stats_threads;
+    stats_threads = ts;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, ts);
+    my_stats = ts;
+    return ts;
+}
+
+struct op_timer stats_op_begin(int op)
+{
+    struct op_timer t = { op, now_ns() };
+    return t;
+}
+
+// runs when the OP_STATS variable goes out of scope, covers every return path
+void stats_op_end(struct op_timer *t)
+{
+    struct thread_stats *ts = stats_mine();
+    if (!ts)
+        return;
+
+    uint64_t ns = now_ns() - t->start;
+    struct op_counter *c = &ts->ops[t->op];
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (b >= STATS_BUCKETS)
+        b = STATS_BUCKETS - 1;
+
+    STAT_ADD(c->calls, 1);
+    STAT_ADD(c->ns_total, ns);
+    STAT_ADD(c->hist[b], 1);
+    if (ns > c->ns_max)
+        __atomic_store_n(&c->ns_max, ns, __ATOMIC_RELAXED);
+}
+
+// where a path lookup ended up: RESOLVE_* code or base layer index
+void stats_layer_hit(int layer)
+{
+    struct thread_stats *ts = stats_mine();
+    if (ts && layer >= RESOLVE_ENOENT && layer < num_base_layers)
+        STAT_ADD(ts->layer_hits[layer - RESOLVE_ENOENT], 1);
+}
+
+// upper bound (us) of the bucket holding the given fraction of calls
+static double hist_percentile(const struct op_counter *c, double frac)
+{
+    uint64_t want = (uint64_t)(c->calls * frac + 0.5), seen = 0;
+
+    if (want == 0)
+        want = 1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += c->hist[b];
+        if (seen >= want) {
+            uint64_t bound = 2ULL << b;
+            return (bound < c->ns_max ? bound : c->ns_max) / 1000.0;
+        }
+    }
+    return c->ns_max / 1000.0;
+}
+
+/* current numbers as text, malloc'd, *len set to its length.
+   NULL when out of memory */
+char *stats_render(size_t *len)
+{
+    struct thread_stats *sum = stats_alloc();
+    struct textbuf tb = TEXTBUF_INIT;
+
+    if (!sum)
+        return NULL;
+
+    pthread_once(&stats_once, stats_init_once);
+    pthread_mutex_lock(&stats_lock);
+    if (stats_retired)
+        stats_fold(sum, stats_retired);
+    for (struct thread_stats *ts = stats_threads; ts; ts = ts->next)
+        stats_fold(sum, ts);
+    pthread_mutex_unlock(&stats_lock);
+
+    textbuf_printf(&tb, "uptime_s %.1f\n\n", monotonic_now() - stats_started);
+
+    textbuf_printf(&tb, "%-12s %12s %10s %10s %10s %10s\n",
+                   "op", "calls", "avg_us", "p50_us", "p99_us", "max_us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        struct op_counter *c = &sum->ops[op];
+        if (c->calls == 0)
+            continue;
+        textbuf_printf(&tb, "%-12s %12llu %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+                       (unsigned long long)c->calls, c->ns_total / 1000.0 / c->calls,
+                       hist_percentile(c, 0.50), hist_percentile(c, 0.99), c->ns_max / 1000.0);
+    }
+
+    textbuf_printf(&tb, "\n%-12s %12s\n", "resolved", "hits");
+    textbuf_printf(&tb, "%-12s %12llu\n", "whiteout",
+                   (unsigned long long)sum->layer_hits[RESOLVE_WHITEOUT - RESOLVE_ENOENT]);
+    textbuf_printf(&tb, "%-12s %12llu\n", "enoent",
+                   (unsigned long long)sum->layer_hits[RESOLVE_ENOENT - RESOLVE_ENOENT]);
+    textbuf_printf(&tb, "%-12s %12llu\n", "session",
+                   (unsigned long long)sum->layer_hits[RESOLVE_SESSION - RESOLVE_ENOENT]);
+    for (int i = 0; i < num_base_layers; i++)
+        textbuf_printf(&tb, "base%-8d %12llu  %s\n", i,
+                       (unsigned long long)sum->layer_hits[i - RESOLVE_ENOENT], base_paths[i]);
+
+    textbuf_printf(&tb, "\n%-16s %12s %16s\n", "copy-up", "count", "bytes");
+    for (int m = 0; m < COW_METHODS; m++)
+        textbuf_printf(&tb, "%-16s %12llu %16llu\n", cow_method_name(m),
+                       (unsigned long long)__atomic_load_n(&cow_stats.count[m], __ATOMIC_RELAXED),
+                       (unsigned long long)__atomic_load_n(&cow_stats.bytes[m], __ATOMIC_RELAXED));
+
+    free(sum);
+    *len = tb.len;
+    return tb.data;
+}
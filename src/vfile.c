@@ -0,0 +1,270 @@
+/* ============================================================
+   PrismaFS - vfile.c
+   Synthetic files under /dev
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+#include <stdarg.h>
+#include <sys/resource.h>
+
+/* -------------------------------------------------------------
+   every file under /dev is one row in vfiles[]: name, mode, a generator
+   producing its content and how long that content may be reused.
+
+   content is generated at open and kept in the file handle, so reads
+   at any offset see the same snapshot. getattr reports the size of the
+   cached content; files that are never cached (ttl 0) report size 0
+   and get opened direct_io, the kernel then reads them until EOF.
+   -------------------------------------------------------------
+*/
+
+/* appends formatted text, buffer grows as needed. on out of memory
+   tb->data is freed and set to NULL, later appends do nothing */
+void textbuf_printf(struct textbuf *tb, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!tb->data) {
+        if (tb->cap != 0)
+            return; // failed before
+        tb->cap = 1024;
+        if (!(tb->data = malloc(tb->cap)))
+            return;
+    }
+
+    va_start(ap, fmt);
+    int n = vsnprintf(tb->data + tb->len, tb->cap - tb->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    if ((size_t)n >= tb->cap - tb->len) {
+        size_t new_cap = tb->cap * 2 + n;
+        char *grown = realloc(tb->data, new_cap);
+        if (!grown) {
+            free(tb->data);
+            tb->data = NULL;
+            return;
+        }
+        tb->data = grown;
+        tb->cap = new_cap;
+
+        va_start(ap, fmt);
+        vsnprintf(tb->data + tb->len, tb->cap - tb->len, fmt, ap);
+        va_end(ap);
+    }
+    tb->len += n;
+}
+
+// /dev/cpu: brand string of the host CPU (machine type on Linux)
+static char *gen_cpu(size_t *lenp)
+{
+    char cpu_brand[256];
+    struct textbuf tb = TEXTBUF_INIT;
+
+    #ifdef __APPLE__
+    size_t len_cpu_brand = sizeof(cpu_brand);
+
+    if (sysctlbyname("machdep.cpu.brand_string", cpu_brand, &len_cpu_brand, NULL, 0) == -1)
+        snprintf(cpu_brand, sizeof(cpu_brand), "Unknown CPU");
+
+    #else
+
+    struct utsname uts;
+    if (uname(&uts) == 0)
+        snprintf(cpu_brand, sizeof(cpu_brand), "%s", uts.machine);
+    else
+        snprintf(cpu_brand, sizeof(cpu_brand), "Unknown CPU");
+
+    #endif
+
+    textbuf_printf(&tb, "CPU Brand: %s\n", cpu_brand);
+    *lenp = tb.len;
+    return tb.data;
+}
+
+// /dev/layers: layer stack in lookup order
+static char *gen_layers(size_t *lenp)
+{
+    struct textbuf tb = TEXTBUF_INIT;
+
+    textbuf_printf(&tb, "session %s\n", session_path);
+    for (int i = 0; i < num_base_layers; i++)
+        textbuf_printf(&tb, "base%d %s%s\n", i, base_paths[i],
+                       (base_flags[i] & LAYER_READONLY) ? " readonly" : "");
+    *lenp = tb.len;
+    return tb.data;
+}
+
+// /dev/config: tunables in effect, same syntax as the config file
+static char *gen_config(size_t *lenp)
+{
+    struct textbuf tb = TEXTBUF_INIT;
+
+    textbuf_printf(&tb, "lookup_ttl %g\n", lookup_ttl);
+    textbuf_printf(&tb, "lookup_cache %zu\n", lookup_cache_slots);
+    textbuf_printf(&tb, "negative_ttl %g\n", negative_ttl);
+    textbuf_printf(&tb, "negative_cache %zu\n", negative_cache_slots);
+    textbuf_printf(&tb, "dircache %zu\n", dircache_slots);
+    textbuf_printf(&tb, "layer_index %zu\n", layer_index_slots);
+    textbuf_printf(&tb, "merge_threads %d\n", merge_threads);
+    textbuf_printf(&tb, "cow_mode %s\n", cow_mode == COW_MODE_SPARSE ? "sparse" : "full");
+    textbuf_printf(&tb, "cow_block %llu\n", (unsigned long long)cow_block);
+    textbuf_printf(&tb, "metacopy %s\n", metacopy ? "on" : "off");
+#ifdef __linux__
+    textbuf_printf(&tb, "backend %s\n", use_lowlevel ? "lowlevel" : "highlevel");
+#endif
+    textbuf_printf(&tb, "entry_timeout %g\n", kcache.entry_timeout);
+    textbuf_printf(&tb, "attr_timeout %g\n", kcache.attr_timeout);
+    textbuf_printf(&tb, "negative_timeout %g\n", kcache.negative_timeout);
+    textbuf_printf(&tb, "readonly_timeout %g\n", kcache.readonly_timeout);
+    textbuf_printf(&tb, "kernel_cache %s\n", kcache.kernel_cache ? "on" : "off");
+    textbuf_printf(&tb, "auto_cache %s\n", kcache.auto_cache ? "on" : "off");
+    textbuf_printf(&tb, "use_ino %s\n", kcache.use_ino ? "on" : "off");
+    if (statfs_total == STATFS_TOTAL_FIXED)
+        textbuf_printf(&tb, "statfs_total %llu\n", (unsigned long long)statfs_total_bytes);
+    else
+        textbuf_printf(&tb, "statfs_total %s\n", statfs_total == STATFS_TOTAL_SUM ? "sum" : "session");
+    textbuf_printf(&tb, "statfs_ttl %g\n", statfs_ttl);
+    *lenp = tb.len;
+    return tb.data;
+}
+
+// /dev/mem: memory use of the prismafs process
+static char *gen_mem(size_t *lenp)
+{
+    struct rusage ru;
+    struct textbuf tb = TEXTBUF_INIT;
+
+#ifdef __linux__
+    // current resident size, only Linux has it without extra APIs
+    unsigned long pages_total, pages_rss;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%lu %lu", &pages_total, &pages_rss) == 2) {
+            long page = sysconf(_SC_PAGESIZE);
+            textbuf_printf(&tb, "vm_kb %lu\n", pages_total * page / 1024);
+            textbuf_printf(&tb, "rss_kb %lu\n", pages_rss * page / 1024);
+        }
+        fclose(f);
+    }
+#endif
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+        textbuf_printf(&tb, "max_rss_kb %ld\n", ru.ru_maxrss / 1024); // bytes on macOS
+#else
+        textbuf_printf(&tb, "max_rss_kb %ld\n", ru.ru_maxrss);
+#endif
+    }
+    *lenp = tb.len;
+    return tb.data;
+}
+
+const struct vfile vfiles[] = {
+    { "cpu",    S_IFREG | 0444, VFILE_FOREVER, gen_cpu },
+    { "stats",  S_IFREG | 0444, 0,             stats_render },
+    { "layers", S_IFREG | 0444, VFILE_FOREVER, gen_layers },
+    { "config", S_IFREG | 0444, VFILE_FOREVER, gen_config },
+    { "mem",    S_IFREG | 0444, 0,             gen_mem },
+    { NULL, 0, 0, NULL }
+};
+
+#define NUM_VFILES (sizeof(vfiles) / sizeof(vfiles[0]) - 1)
+
+// reusable content per vfile, guarded by vfile_lock
+static struct vcontent *vfile_cache[NUM_VFILES];
+static double vfile_expires[NUM_VFILES];
+static pthread_mutex_t vfile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// "/dev/<name>" -> registry entry, NULL when path isnt a vfile
+const struct vfile *vfile_lookup(const char *path)
+{
+    if (strncmp(path, "/dev/", 5) != 0)
+        return NULL;
+
+    for (const struct vfile *vf = vfiles; vf->name; vf++)
+        if (strcmp(path + 5, vf->name) == 0)
+            return vf;
+    return NULL;
+}
+
+void vcontent_put(struct vcontent *vc)
+{
+    if (!vc || __atomic_sub_fetch(&vc->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    free(vc->data);
+    free(vc);
+}
+
+static struct vcontent *vcontent_generate(const struct vfile *vf)
+{
+    struct vcontent *vc = malloc(sizeof(*vc));
+    if (!vc)
+        return NULL;
+
+    vc->refs = 1;
+    vc->data = vf->generate(&vc->len);
+    if (!vc->data) {
+        free(vc);
+        return NULL;
+    }
+    return vc;
+}
+
+/* referenced content for vf, from cache while its ttl lasts.
+   NULL = out of memory */
+struct vcontent *vfile_content(const struct vfile *vf)
+{
+    size_t i = vf - vfiles;
+    struct vcontent *vc;
+
+    if (vf->ttl == 0)
+        return vcontent_generate(vf);
+
+    double now = monotonic_now();
+    pthread_mutex_lock(&vfile_lock);
+    vc = vfile_cache[i];
+    if (vc && (vf->ttl < 0 || now < vfile_expires[i])) {
+        __atomic_add_fetch(&vc->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&vfile_lock);
+        return vc;
+    }
+    pthread_mutex_unlock(&vfile_lock);
+
+    // generate outside the lock, two threads may race, last one wins the slot
+    vc = vcontent_generate(vf);
+    if (!vc)
+        return NULL;
+
+    pthread_mutex_lock(&vfile_lock);
+    struct vcontent *old = vfile_cache[i];
+    __atomic_add_fetch(&vc->refs, 1, __ATOMIC_RELAXED);
+    vfile_cache[i] = vc;
+    vfile_expires[i] = now + vf->ttl;
+    pthread_mutex_unlock(&vfile_lock);
+
+    vcontent_put(old);
+    return vc;
+}
+
+void vfile_getattr(const struct vfile *vf, struct stat *stbuf)
+{
+    stbuf->st_mode  = vf->mode;
+    stbuf->st_nlink = 1;
+
+    // cached files have a known size, never-cached ones are read with direct_io
+    if (vf->ttl != 0) {
+        struct vcontent *vc = vfile_content(vf);
+        if (vc)
+            stbuf->st_size = vc->len;
+        vcontent_put(vc);
+    }
+}
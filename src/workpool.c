@@ -0,0 +1,143 @@
+/* ============================================================
+   PrismaFS - workpool.c
+   Small worker pool for splitting one request across layers
+
+   Copyright 2026 Goran B.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+   ============================================================ */
+#include "prismafs.h"
+
+/* -------------------------------------------------------------
+   a job is "run fn(arg, i) for i in 0..n-1". workpool_submit() queues
+   it, pool threads take indices off it one at a time, and the submitter
+   joins in from workpool_wait() so a job finishes even when every
+   worker is busy with other requests (or there are none).
+
+   threads start on first submit: fuse_main() forks into the background
+   after main() returns, threads started before that would be lost.
+   -------------------------------------------------------------
+*/
+
+int merge_threads = 4;   // pool size, 0 = everything runs in the caller
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_work = PTHREAD_COND_INITIALIZER;  // queue got a job
+static pthread_cond_t  pool_done = PTHREAD_COND_INITIALIZER;  // some job finished
+static struct work_job *queue_head = NULL, *queue_tail = NULL;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// next index of the head job, dequeues it once all are handed out. holds pool_lock
+static struct work_job *take_task(int *index)
+{
+    struct work_job *job = queue_head;
+
+    if (!job)
+        return NULL;
+
+    *index = job->next++;
+    if (job->next >= job->n) {
+        queue_head = job->qnext;
+        if (!queue_head)
+            queue_tail = NULL;
+    }
+    return job;
+}
+
+// runs one task without the lock, then counts it. holds pool_lock
+static void run_task(struct work_job *job, int index)
+{
+    pthread_mutex_unlock(&pool_lock);
+    job->fn(job->arg, index);
+    pthread_mutex_lock(&pool_lock);
+
+    // submitter may return as soon as this hits n, job isnt touched after
+    if (++job->done == job->n)
+        pthread_cond_broadcast(&pool_done);
+}
+
+static void *pool_thread(void *arg)
+{
+    (void) arg;
+    int index;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        struct work_job *job = take_task(&index);
+        if (!job) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+            continue;
+        }
+        run_task(job, index);
+    }
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    for (int i = 0; i < merge_threads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, pool_thread, NULL) != 0) {
+            fprintf(stderr, "prismafs: started %d of %d merge threads\n", i, merge_threads);
+            break;
+        }
+        pthread_detach(t);
+    }
+}
+
+void workpool_submit(struct work_job *job)
+{
+    job->next = 0;
+    job->done = 0;
+    job->qnext = NULL;
+    if (job->n <= 0 || merge_threads <= 0)
+        return; // workpool_wait() runs it
+
+    pthread_once(&pool_once, pool_start);
+
+    pthread_mutex_lock(&pool_lock);
+    if (queue_tail)
+        queue_tail->qnext = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// returns once every task of job ran, running whatever is still queued
+void workpool_wait(struct work_job *job)
+{
+    if (job->n <= 0)
+        return;
+
+    if (merge_threads <= 0) {
+        for (int i = 0; i < job->n; i++)
+            job->fn(job->arg, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (job->next < job->n) {
+        // still queued: take the next index of this job (it may not be the head)
+        int index = job->next++;
+        if (job->next >= job->n) {
+            struct work_job **pp = &queue_head, *prev = NULL;
+            while (*pp != job) {
+                prev = *pp;
+                pp = &(*pp)->qnext;
+            }
+            *pp = job->qnext;
+            if (queue_tail == job)
+                queue_tail = prev;
+        }
+        run_task(job, index);
+    }
+    while (job->done < job->n)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}